@@ -21,6 +21,7 @@
  */
 
 #include <assert.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,6 +32,9 @@
 #include "common.h"
 #include "lowlevel.h"
 
+/* Time to wait for the brick in bootloader mode after reset, in seconds. */
+#define COMMON_RESET_TIMEOUT 20.0
+
 int
 handle_error(nxt_t *nxt, const char *msg, nxt_error_t err)
 {
@@ -52,23 +56,24 @@ list_cb(void *user, const char *connection, nxt_firmware fw, const char *serial,
 
   if (!*seen)
     {
-      printf("%-11s  %-8s  %-17s  %s\n", "Connection", "Firmware",
+      printf("%-15s  %-8s  %-17s  %s\n", "Connection", "Firmware",
              "Serial number", "Brick name");
       *seen = true;
     }
-  printf("%-11s  %-8s  %-17s  %s\n", connection, fws[fw], serial ? serial : "-",
+  printf("%-15s  %-8s  %-17s  %s\n", connection, fws[fw], serial ? serial : "-",
          name ? name : "-");
 }
 
 static void
-common_list(void)
+common_list(bool names)
 {
   nxt_t *nxt;
   bool seen = false;
 
   NXT_HANDLE_ERR(nxt_init(&nxt), NULL, "Error during library initialization");
 
-  NXT_HANDLE_ERR(nxt_list(nxt, list_cb, &seen), nxt,
+  // Without names, bricks are not opened, nor disturbed.
+  NXT_HANDLE_ERR(nxt_list_devices(nxt, names, list_cb, &seen), nxt,
                  "Error while scanning for bricks");
   if (!seen)
     fputs("No brick found\n", stdout);
@@ -89,7 +94,7 @@ common_getopt(int argc, char *const *argv, const char *optstring,
       switch (c)
         {
         case 'l':
-          common_options->list = true;
+          common_options->list++;
           break;
         case 'y':
           common_options->yes = true;
@@ -100,6 +105,12 @@ common_getopt(int argc, char *const *argv, const char *optstring,
         case 'b':
           common_options->bootloader_mode_only = true;
           break;
+        case 'p':
+          // Accept the connection string printed by the list option.
+          if (strncmp(optarg, "usb.", 4) == 0)
+            optarg += 4;
+          common_options->match_port = optarg;
+          break;
         case 's':
           common_options->match_serial = optarg;
           break;
@@ -117,7 +128,7 @@ common_getopt(int argc, char *const *argv, const char *optstring,
           fprintf(stderr, "Too many arguments with -l option\n");
           usage(argv[0], 1);
         }
-      common_list();
+      common_list(common_options->list > 1);
       exit(0);
     }
   return -1;
@@ -127,6 +138,7 @@ static nxt_error_t
 common_reset_bootloader(nxt_t *nxt, bool yes)
 {
   char rep[80];
+  char port_path[NXT_PORT_PATH_SIZE];
   nxt_error_t err;
 
   if (!yes)
@@ -155,22 +167,16 @@ common_reset_bootloader(nxt_t *nxt, bool yes)
         }
     }
 
+  // The brick comes back in bootloader mode on the same port.
+  NXT_HANDLE_ERR(nxt_get_port_path(nxt, port_path, sizeof(port_path)), nxt,
+                 "Error while resetting");
   printf("Resetting brick, it should make a clicking noise...\n");
   NXT_HANDLE_ERR(nxt_cmd_boot(nxt, true), nxt, "Error while resetting");
   nxt_close(nxt);
 
-  for (int i = 0; i < 20; i++)
-    {
-      putchar('.');
-      fflush(stdout);
-      sleep(1);
-      err = nxt_find(nxt, SAMBA, NULL, NULL);
-      if (err != NXT_NOT_PRESENT)
-        NXT_HANDLE_ERR(err, nxt, "Error while scanning for NXT bootloader");
-      if (!err)
-        break;
-    }
-  putchar('\n');
+  err = nxt_wait(nxt, SAMBA, port_path, COMMON_RESET_TIMEOUT);
+  if (err != NXT_NOT_PRESENT)
+    NXT_HANDLE_ERR(err, nxt, "Error while scanning for NXT bootloader");
 
   return err;
 }
@@ -180,15 +186,24 @@ common_find_bootloader(nxt_t *nxt, const common_options_t *common_options)
 {
   nxt_error_t err;
 
-  err = nxt_find(nxt, SAMBA, NULL, NULL);
+  // Avoid resetting a brick again after it was opened to check its name.
+  nxt_set_persistent(nxt, true);
+
+  if (common_options->match_port)
+    err = nxt_find_port(nxt, SAMBA, common_options->match_port);
+  else
+    err = nxt_find(nxt, SAMBA, NULL, NULL);
   if (err != NXT_NOT_PRESENT)
     NXT_HANDLE_ERR(err, nxt, "Error while scanning for NXT bootloader");
 
   if (err == NXT_NOT_PRESENT && !common_options->bootloader_mode_only)
     {
       // Try to find a device not in bootloader mode.
-      err = nxt_find(nxt, LEGO, common_options->match_serial,
-                     common_options->match_name);
+      if (common_options->match_port)
+        err = nxt_find_port(nxt, LEGO, common_options->match_port);
+      else
+        err = nxt_find(nxt, LEGO, common_options->match_serial,
+                       common_options->match_name);
       if (err != NXT_NOT_PRESENT)
         NXT_HANDLE_ERR(err, nxt, "Error while scanning for NXT");
       if (!err)
@@ -203,3 +218,56 @@ common_find_bootloader(nxt_t *nxt, const common_options_t *common_options)
 
   assert(err == NXT_OK);
 }
+
+static volatile sig_atomic_t common_interrupted;
+
+static void
+common_sigint(int sig)
+{
+  (void)sig;
+  common_interrupted = 1;
+}
+
+void
+common_progress_init(void)
+{
+  // First interruption cancels the operation cleanly.
+  signal(SIGINT, common_sigint);
+}
+
+bool
+common_cancelled(void)
+{
+  return common_interrupted;
+}
+
+bool
+common_progress(void *user, const nxt_progress_t *progress)
+{
+  (void)user;
+
+  if (!isatty(fileno(stdout)))
+    return !common_interrupted;
+
+  if (progress->pages_total)
+    printf("\r%d/%d pages", progress->pages, progress->pages_total);
+  else
+    printf("\r%lu/%lu bytes", progress->bytes, progress->bytes_total);
+  printf(", %.1f KiB/s (average %.1f KiB/s)", progress->rate / 1024,
+         progress->average_rate / 1024);
+  if (progress->eta >= 0)
+    printf(", %.0f s left  ", progress->eta);
+  if (progress->bytes >= progress->bytes_total)
+    putchar('\n');
+  fflush(stdout);
+
+  if (common_interrupted)
+    {
+      printf("\nInterrupted, cancelling...\n");
+      // Second interruption is not delayed.
+      signal(SIGINT, SIG_DFL);
+      return false;
+    }
+
+  return true;
+}
@@ -27,14 +27,16 @@
 
 #include "error.h"
 #include "lowlevel.h"
+#include "samba.h"
 
-#define COMMON_OPTSTRING "lyhbs:n:"
+#define COMMON_OPTSTRING "lyhbp:s:n:"
 #define COMMON_OPTIONS                                                     \
-  "  -l         list detected devices\n"                                   \
+  "  -l         list detected devices, twice to also query brick names\n"  \
   "  -y         allow reset to bootloader mode (erase device memory)\n"    \
   "  -h         print this help message\n"                                 \
-  "Device selection option:\n"                                             \
+  "Device selection options:\n"                                            \
   "  -b         select device in bootloader mode only\n"                   \
+  "  -p PORT    select device on this USB port (e.g. usb.1-2.3)\n"         \
   "Device selection options (not in bootloader mode):\n"                   \
   "  -s SERIAL  select device with this serial (e.g. 00:16:53:01:02:03)\n" \
   "  -n NAME    select device with this name (e.g. NXT)\n"
@@ -50,9 +52,10 @@
 
 typedef struct
 {
-  bool list;
+  int list;
   bool yes;
   bool bootloader_mode_only;
+  const char *match_port;
   const char *match_serial;
   const char *match_name;
 } common_options_t;
@@ -62,5 +65,8 @@ int common_getopt(int argc, char *const *argv, const char *optstring,
                   common_options_t *common_options,
                   void (*usage)(const char *, int));
 void common_find_bootloader(nxt_t *nxt, const common_options_t *common_options);
+void common_progress_init(void);
+bool common_cancelled(void);
+bool common_progress(void *user, const nxt_progress_t *progress);
 
 #endif /* __COMMON_H__ */
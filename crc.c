@@ -0,0 +1,84 @@
+/**
+ * NXT bootstrap interface; CRC computation code.
+ *
+ * Copyright 2026 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <assert.h>
+
+#include "crc.h"
+
+#include "crc_routine.h"
+
+/* Same layout as in crc32/crc32.c. */
+#define NXT_CRC_DESC_OFFSET 0x800
+#define NXT_CRC_RESULT_OFFSET 0x80c
+
+static const uint32_t crc32_nibble[16] = {
+  0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4,
+  0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+  0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+};
+
+uint32_t
+nxt_crc32(uint32_t crc, const uint8_t *buf, size_t len)
+{
+  crc = ~crc;
+  while (len--)
+    {
+      crc = crc32_nibble[(crc ^ *buf) & 0xf] ^ (crc >> 4);
+      crc = crc32_nibble[(crc ^ (*buf >> 4)) & 0xf] ^ (crc >> 4);
+      buf++;
+    }
+  return ~crc;
+}
+
+nxt_error_t
+nxt_crc32_remote_load(nxt_t *nxt, nxt_addr_t base)
+{
+  return nxt_send_file(nxt, base, crc_bin, crc_len);
+}
+
+nxt_error_t
+nxt_crc32_remote(nxt_t *nxt, nxt_addr_t base, nxt_addr_t addr, nxt_word_t len,
+                 int count, uint32_t *crcs)
+{
+  uint8_t desc[12];
+  uint8_t result[NXT_CRC_MAX_BLOCKS * 4];
+
+  assert(count > 0 && count <= NXT_CRC_MAX_BLOCKS);
+
+  // Start address, block length and block count, in little-endian.
+  for (int i = 0; i < 4; i++)
+    {
+      desc[i] = addr >> (i * 8);
+      desc[4 + i] = len >> (i * 8);
+      desc[8 + i] = (nxt_word_t)count >> (i * 8);
+    }
+  NXT_ERR(nxt_send_file(nxt, base + NXT_CRC_DESC_OFFSET, desc, sizeof(desc)));
+
+  NXT_ERR(nxt_jump(nxt, base));
+
+  NXT_ERR(nxt_recv_file(nxt, base + NXT_CRC_RESULT_OFFSET, result, count * 4));
+  for (int i = 0; i < count; i++)
+    crcs[i] = result[i * 4] | result[i * 4 + 1] << 8 |
+              (uint32_t)result[i * 4 + 2] << 16 |
+              (uint32_t)result[i * 4 + 3] << 24;
+
+  return NXT_OK;
+}
@@ -0,0 +1,43 @@
+/**
+ * NXT bootstrap interface; CRC computation code.
+ *
+ * Copyright 2026 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#ifndef __CRC_H__
+#define __CRC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "lowlevel.h"
+#include "samba.h"
+
+/* Space needed in RAM to run the CRC routine for the given number of
+ * blocks. */
+#define NXT_CRC_ROUTINE_SIZE(count) (0x80c + (count) * 4)
+#define NXT_CRC_MAX_BLOCKS 1024
+
+uint32_t nxt_crc32(uint32_t crc, const uint8_t *buf, size_t len);
+
+nxt_error_t nxt_crc32_remote_load(nxt_t *nxt, nxt_addr_t base);
+nxt_error_t nxt_crc32_remote(nxt_t *nxt, nxt_addr_t base, nxt_addr_t addr,
+                             nxt_word_t len, int count, uint32_t *crcs);
+
+#endif /* __CRC_H__ */
@@ -0,0 +1,60 @@
+/**
+ * NXT bootstrap interface; NXT onboard CRC driver.
+ *
+ * Copyright 2026 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/* Everything is relative to the routine load address, so that it can be
+ * placed anywhere in RAM:
+ *  - 0x000: routine code,
+ *  - 0x400: CRC table, computed at each run,
+ *  - 0x800: descriptor: start address, block length, block count,
+ *  - 0x80c: results, one CRC per block.
+ */
+#define CRC_TABLE(base) ((base) + 0x100)
+#define CRC_DESC(base) ((base) + 0x200)
+
+#define CRC_POLY 0xEDB88320
+
+void
+do_crc32(volatile unsigned int *base)
+{
+  volatile unsigned int *table = CRC_TABLE(base);
+  volatile unsigned int *desc = CRC_DESC(base);
+  const unsigned char *addr = (const unsigned char *)desc[0];
+  unsigned int len = desc[1];
+  unsigned int count = desc[2];
+  volatile unsigned int *result = desc + 3;
+  unsigned int i, n, crc;
+
+  for (i = 0; i < 256; i++)
+    {
+      crc = i;
+      for (n = 0; n < 8; n++)
+        crc = (crc >> 1) ^ (crc & 1 ? CRC_POLY : 0);
+      table[i] = crc;
+    }
+
+  for (n = 0; n < count; n++)
+    {
+      crc = 0xFFFFFFFF;
+      for (i = 0; i < len; i++)
+        crc = table[(crc ^ *addr++) & 0xFF] ^ (crc >> 8);
+      result[n] = ~crc;
+    }
+}
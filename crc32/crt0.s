@@ -0,0 +1,36 @@
+/**
+ * NXT bootstrap interface; NXT onboard CRC driver bootstrap.
+ *
+ * Copyright 2026 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+.text
+.align 4
+.globl _start
+
+_start:
+	/* Keep the SAM-BA stack, this routine can be loaded anywhere in RAM,
+	 * including at the top. Preserve old link register */
+	stmfd sp!, {lr}
+
+	/* Call main with the routine load address */
+	adr r0, _start
+	bl do_crc32
+
+	/* Return */
+	ldmfd sp!, {pc}
@@ -32,6 +32,10 @@ static const char *const err_str[] = {
   "Invalid firmware image",
   "Exhausted virtual memory",
   "Communication protocol error",
+  "Memory content verification failed",
+  "Operation cancelled",
+  "Operation timed out",
+  "Flash programming failed",
 };
 
 const char *
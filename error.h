@@ -34,6 +34,10 @@ typedef enum
   NXT_INVALID_FIRMWARE = 4,
   NXT_ERROR_NO_MEM = 5,
   NXT_ERROR_PROTO = 6,
+  NXT_VERIFY_FAILED = 7,
+  NXT_CANCELLED = 8,
+  NXT_TIMEOUT = 9,
+  NXT_FLASH_FAILED = 10,
   NXT_ERROR_CMD_MIN = 0x100,
   NXT_ERROR_USB_MIN = 1000,
 } nxt_error_t;
@@ -0,0 +1,282 @@
+/**
+ * Flash several NXT bricks at once.
+ *
+ * Copyright 2026 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "farm.h"
+
+#include "cmd.h"
+#include "lowlevel.h"
+#include "samba.h"
+
+#define FARM_MAX_BRICKS 64
+/* Time to wait for a brick to show up in bootloader mode, and for the new
+ * firmware to answer, in seconds. */
+#define FARM_RESET_TIMEOUT 20.0
+#define FARM_BOOT_TIMEOUT 10.0
+
+typedef struct
+{
+  char port_path[NXT_PORT_PATH_SIZE];
+  nxt_firmware fw;
+  nxt_context_t *ctx;
+  const nxt_image_t *image;
+  nxt_firmware_options_t options;
+  bool check;
+  bool no_wait;
+  pthread_t thread;
+  bool started;
+  /* Updated by worker, protected by farm_lock. */
+  nxt_progress_t progress;
+  const char *state;
+  nxt_error_t err;
+  bool done;
+  double seconds;
+  nxt_firmware_boot_t boot;
+} farm_brick_t;
+
+typedef struct
+{
+  farm_brick_t bricks[FARM_MAX_BRICKS];
+  int count;
+  /* Only flash bricks already in bootloader mode. */
+  bool bootloader_mode_only;
+} farm_t;
+
+static pthread_mutex_t farm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+farm_set_state(farm_brick_t *brick, const char *state)
+{
+  pthread_mutex_lock(&farm_lock);
+  brick->state = state;
+  pthread_mutex_unlock(&farm_lock);
+}
+
+static bool
+farm_progress(void *user, const nxt_progress_t *progress)
+{
+  farm_brick_t *brick = user;
+
+  pthread_mutex_lock(&farm_lock);
+  brick->progress = *progress;
+  pthread_mutex_unlock(&farm_lock);
+
+  return !common_cancelled();
+}
+
+static nxt_error_t
+farm_flash_brick(farm_brick_t *brick, nxt_t *nxt)
+{
+  nxt_error_t err;
+
+  if (brick->fw == LEGO)
+    {
+      farm_set_state(brick, "resetting");
+      NXT_ERR(nxt_find_port(nxt, LEGO, brick->port_path));
+      NXT_ERR(nxt_open(nxt));
+      NXT_ERR(nxt_cmd_boot(nxt, true));
+      nxt_close(nxt);
+    }
+
+  // The brick comes back in bootloader mode on the same port.
+  farm_set_state(brick, "waiting");
+  NXT_ERR(nxt_wait(nxt, SAMBA, brick->port_path, FARM_RESET_TIMEOUT));
+
+  NXT_ERR(nxt_open(nxt));
+  NXT_ERR(nxt_handshake(nxt));
+
+  farm_set_state(brick, "flashing");
+  NXT_ERR(nxt_firmware_flash_image(nxt, brick->image, &brick->options, NULL));
+  if (brick->check)
+    {
+      farm_set_state(brick, "checking");
+      NXT_ERR(nxt_firmware_check(nxt, brick->image, brick->options.manifest));
+    }
+  if (brick->no_wait)
+    return nxt_jump(nxt, 0x00100000);
+
+  // As for a single brick, the new firmware is started even if it does not
+  // answer.
+  farm_set_state(brick, "booting");
+  err = nxt_firmware_boot(nxt, FARM_BOOT_TIMEOUT, &brick->boot);
+  return err == NXT_NOT_PRESENT ? NXT_OK : err;
+}
+
+static void *
+farm_worker(void *user)
+{
+  farm_brick_t *brick = user;
+  double start = nxt_progress_time();
+  nxt_t *nxt;
+  nxt_error_t err;
+
+  // Each worker has its own handle on the shared context.
+  err = nxt_open_context(&nxt, brick->ctx);
+  if (err == NXT_OK)
+    {
+      err = farm_flash_brick(brick, nxt);
+      nxt_exit(nxt);
+    }
+
+  pthread_mutex_lock(&farm_lock);
+  brick->err = err;
+  brick->state = err == NXT_OK ? "done" : "failed";
+  brick->done = true;
+  brick->seconds = nxt_progress_time() - start;
+  pthread_mutex_unlock(&farm_lock);
+
+  return NULL;
+}
+
+static void
+farm_list_cb(void *user, const char *port_path, nxt_firmware fw)
+{
+  farm_t *farm = user;
+
+  // Other firmwares can not be reset to bootloader mode.
+  if ((fw != SAMBA && fw != LEGO) || farm->count == FARM_MAX_BRICKS)
+    return;
+  if (fw == LEGO && farm->bootloader_mode_only)
+    return;
+
+  strcpy(farm->bricks[farm->count].port_path, port_path);
+  farm->bricks[farm->count].fw = fw;
+  farm->count++;
+}
+
+static bool
+farm_report(farm_t *farm)
+{
+  int done = 0, failed = 0, pages = 0, pages_total = 0;
+  double rate = 0.0;
+
+  pthread_mutex_lock(&farm_lock);
+  for (int i = 0; i < farm->count; i++)
+    {
+      farm_brick_t *brick = &farm->bricks[i];
+      done += brick->done;
+      failed += brick->done && brick->err != NXT_OK;
+      pages += brick->progress.pages;
+      pages_total += brick->progress.pages_total;
+      if (!brick->done)
+        rate += brick->progress.average_rate;
+    }
+  pthread_mutex_unlock(&farm_lock);
+
+  if (isatty(fileno(stdout)))
+    {
+      printf("\r%d/%d bricks done, %d failed, %d/%d pages, %.1f KiB/s  ",
+             done, farm->count, failed, pages, pages_total, rate / 1024);
+      fflush(stdout);
+    }
+
+  return done == farm->count;
+}
+
+int
+farm_flash(const nxt_image_t *image, const nxt_firmware_options_t *options,
+           bool check, bool no_wait, const common_options_t *common_options)
+{
+  static farm_t farm;
+  const struct timespec poll = { 0, 500000000 };
+  nxt_context_t *ctx;
+  nxt_t *nxt;
+  int failed = 0;
+
+  NXT_HANDLE_ERR(nxt_context_init(&ctx), NULL,
+                 "Error during library initialization");
+  NXT_HANDLE_ERR(nxt_open_context(&nxt, ctx), NULL,
+                 "Error during library initialization");
+  farm.bootloader_mode_only = common_options->bootloader_mode_only;
+  NXT_HANDLE_ERR(nxt_list_ports(nxt, farm_list_cb, &farm), nxt,
+                 "Error while scanning for bricks");
+  nxt_exit(nxt);
+
+  if (!farm.count)
+    {
+      fprintf(stderr, "NXT not found. Is it properly plugged in via USB?\n");
+      nxt_context_exit(ctx);
+      return 1;
+    }
+  for (int i = 0; i < farm.count; i++)
+    {
+      if (farm.bricks[i].fw == LEGO && !common_options->yes)
+        {
+          fprintf(stderr, "Some bricks are not in bootloader mode, use -y "
+                          "to reset them (this erases their memory).\n");
+          nxt_context_exit(ctx);
+          return 1;
+        }
+    }
+
+  printf("Flashing %d bricks...\n", farm.count);
+  common_progress_init();
+
+  // One worker per brick, they share the same image.
+  for (int i = 0; i < farm.count; i++)
+    {
+      farm_brick_t *brick = &farm.bricks[i];
+      brick->ctx = ctx;
+      brick->image = image;
+      brick->options = *options;
+      brick->options.progress = farm_progress;
+      brick->options.progress_user = brick;
+      brick->check = check;
+      brick->no_wait = no_wait;
+      brick->state = "starting";
+      brick->started
+          = pthread_create(&brick->thread, NULL, farm_worker, brick) == 0;
+      if (!brick->started)
+        {
+          brick->err = NXT_ERROR_NO_MEM;
+          brick->state = "failed";
+          brick->done = true;
+        }
+    }
+
+  while (!farm_report(&farm))
+    nanosleep(&poll, NULL);
+  putchar('\n');
+
+  for (int i = 0; i < farm.count; i++)
+    {
+      farm_brick_t *brick = &farm.bricks[i];
+      if (brick->started)
+        pthread_join(brick->thread, NULL);
+      printf("%-20s  %-6s  %5.1f s", brick->port_path, brick->state,
+             brick->seconds);
+      if (brick->boot.ready > 0)
+        printf(", ready after %.2f s", brick->boot.ready);
+      else if (brick->err == NXT_OK && !brick->no_wait)
+        printf(", did not answer");
+      printf("  %s\n", nxt_str_error(brick->err));
+      failed += brick->err != NXT_OK;
+    }
+  nxt_context_exit(ctx);
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,35 @@
+/**
+ * Flash several NXT bricks at once.
+ *
+ * Copyright 2026 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#ifndef __FARM_H__
+#define __FARM_H__
+
+#include <stdbool.h>
+
+#include "common.h"
+#include "firmware.h"
+#include "image.h"
+
+int farm_flash(const nxt_image_t *image,
+               const nxt_firmware_options_t *options, bool check,
+               bool no_wait, const common_options_t *common_options);
+
+#endif /* __FARM_H__ */
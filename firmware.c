@@ -19,86 +19,345 @@
  * USA
  */
 
-#include <fcntl.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
-#include <unistd.h>
+#include <time.h>
 
 #include "firmware.h"
 
+#include "cmd.h"
+#include "crc.h"
 #include "error.h"
 #include "flash.h"
 #include "flash_routine.h"
+#include "journal.h"
 #include "lowlevel.h"
+#include "manifest.h"
 #include "samba.h"
 
+/* Flash writing routine and its batch descriptor in SRAM, see
+ * flash_write/flash.c. */
+#define NXT_FLASH_ROUTINE_ADDR 0x202000
+#define NXT_FLASH_BATCH_ADDR 0x202400
+#define NXT_FLASH_BATCH_PAGES 32
+#define NXT_FLASH_BATCH_SIZE(pages) (24 + (pages) * (4 + NXT_FLASH_PAGE_SIZE))
+#define NXT_FLASH_BATCH_ERASE_ALL 0x1
+#define NXT_FLASH_BATCH_PAGE_NO_ERASE 0x80000000
+
+/* Completion status written by the flash routine, after the batch
+ * descriptor: started pages, pages confirmed to be programmed, and flash
+ * controller errors. */
+#define NXT_FLASH_STATUS_ADDR 0x204600
+#define NXT_FLASH_STATUS_SIZE 12
+
+/* CRC routine, after the flash routine status. */
+#define NXT_FLASH_CRC_ADDR 0x204800
+
+#define NXT_FLASH_REGION_PAGES 64
+
+/* Pages read back at once, SAM-BA read size is limited to 64 KiB. */
+#define NXT_FLASH_READ_PAGES 255
+
+typedef struct
+{
+  nxt_t *nxt;
+  const nxt_image_t *image;
+  const nxt_flash_profile_t *profile;
+  /* Pages to program. */
+  bool program[NXT_FLASH_PAGES];
+  /* Pages known to be erased. */
+  bool erased[NXT_FLASH_PAGES];
+  /* Erase the whole flash before programming. */
+  bool erase_all;
+  /* Erase All is not confirmed yet, it is done with the first batch. */
+  bool erase_pending;
+  /* Lock regions after programming. */
+  bool relock;
+  /* Progress, pages confirmed to be programmed, and where to save it. */
+  nxt_journal_t journal;
+  const char *journal_path;
+  /* Progress report. */
+  nxt_progress_tracker_t progress;
+  nxt_progress_cb_t progress_cb;
+  void *progress_user;
+  /* Batch descriptor, built in place for sending. */
+  nxt_samba_buf_t batch;
+  /* Pages to program in this run in order, number of pages started by the
+   * flash routine, and number of them confirmed in the journal. */
+  int list[NXT_FLASH_PAGES];
+  int started;
+  int confirmed;
+} nxt_flash_job_t;
+
+static uint16_t
+nxt_flash_regions(const bool *pages)
+{
+  uint16_t regions = 0;
+
+  for (int i = 0; i < NXT_FLASH_PAGES; i++)
+    {
+      if (pages[i])
+        regions |= 1 << (i / NXT_FLASH_REGION_PAGES);
+    }
+
+  return regions;
+}
+
 static nxt_error_t
-nxt_flash_prepare(nxt_t *nxt)
+nxt_flash_prepare(nxt_flash_job_t *job)
 {
-  // Put the clock in PLL/2 mode
-  NXT_ERR(nxt_write_word(nxt, 0xFFFFFC30, 0x7));
+  uint8_t status[NXT_FLASH_STATUS_SIZE] = { 0 };
 
-  // Unlock the flash chip
-  NXT_ERR(nxt_flash_unlock_all_regions(nxt));
+  // Setup clock
+  NXT_ERR(nxt_flash_setup(job->nxt, job->profile));
 
-  // Send the flash writing routine
-  NXT_ERR(nxt_send_file(nxt, 0x202000, flash_bin, flash_len));
+  // Send the flash writing routine, and clear its status
+  NXT_ERR(nxt_send_file(job->nxt, NXT_FLASH_ROUTINE_ADDR, flash_bin,
+                        flash_len));
+  NXT_ERR(nxt_send_file(job->nxt, NXT_FLASH_STATUS_ADDR, status,
+                        sizeof(status)));
+  job->started = 0;
+  job->confirmed = 0;
 
   return NXT_OK;
 }
 
+static void
+nxt_flash_put_word(uint8_t *p, nxt_word_t w)
+{
+  p[0] = w & 0xff;
+  p[1] = (w >> 8) & 0xff;
+  p[2] = (w >> 16) & 0xff;
+  p[3] = (w >> 24) & 0xff;
+}
+
 static nxt_error_t
-nxt_flash_block(nxt_t *nxt, nxt_word_t block_num, const uint8_t *buf)
+nxt_flash_batch(nxt_flash_job_t *job, const int *pages, int count, bool first,
+                bool last)
 {
-  // Set the target block number
-  NXT_ERR(nxt_write_word(nxt, 0x202300, block_num));
+  uint8_t *p = job->batch.data;
+  uint16_t regions = nxt_flash_regions(job->program);
+  nxt_word_t header[6];
+
+  // Build the batch descriptor: flash modes, regions to unlock first and to
+  // lock last, flags, page count, page numbers, then page data.
+  header[0] = nxt_flash_profile_fmr_write(job->profile);
+  header[1] = nxt_flash_profile_fmr_nvm(job->profile);
+  header[2] = first ? (job->erase_pending ? 0xffff : regions) : 0;
+  header[3] = last && job->relock ? regions : 0;
+  header[4] = first && job->erase_pending ? NXT_FLASH_BATCH_ERASE_ALL : 0;
+  header[5] = count;
+  for (int i = 0; i < 6; i++)
+    {
+      nxt_flash_put_word(p, header[i]);
+      p += 4;
+    }
+  for (int i = 0; i < count; i++)
+    {
+      nxt_word_t w = pages[i];
+      if (job->profile->nebp && job->erased[pages[i]])
+        w |= NXT_FLASH_BATCH_PAGE_NO_ERASE;
+      nxt_flash_put_word(p, w);
+      p += 4;
+    }
+  for (int i = 0; i < count; i++)
+    {
+      memcpy(p, job->image->data + pages[i] * NXT_FLASH_PAGE_SIZE,
+             NXT_FLASH_PAGE_SIZE);
+      p += NXT_FLASH_PAGE_SIZE;
+    }
 
-  // Send the block to flash
-  NXT_ERR(nxt_send_file(nxt, 0x202100, buf, 256));
+  // Send the whole batch at once
+  NXT_ERR(nxt_send_samba_buf(job->nxt, NXT_FLASH_BATCH_ADDR, &job->batch,
+                             NXT_FLASH_BATCH_SIZE(count)));
 
-  // Jump into the flash writing routine
-  NXT_ERR(nxt_jump(nxt, 0x202000));
+  // Jump into the flash writing routine, it returns as soon as the last
+  // page is started
+  NXT_ERR(nxt_jump(job->nxt, NXT_FLASH_ROUTINE_ADDR));
+  job->started += count;
 
   return NXT_OK;
 }
 
+/* Read the flash routine status and mark confirmed pages as done in the
+ * journal. The read is only answered once the routine has returned. */
 static nxt_error_t
-nxt_flash_finish(nxt_t *nxt)
+nxt_flash_confirm(nxt_flash_job_t *job)
 {
-  return nxt_flash_wait_ready(nxt);
+  uint8_t buf[NXT_FLASH_STATUS_SIZE];
+  nxt_word_t status[NXT_FLASH_STATUS_SIZE / 4];
+
+  NXT_ERR(nxt_recv_file(job->nxt, NXT_FLASH_STATUS_ADDR, buf, sizeof(buf)));
+  for (int i = 0; i < NXT_FLASH_STATUS_SIZE / 4; i++)
+    status[i] = buf[i * 4] | buf[i * 4 + 1] << 8 | buf[i * 4 + 2] << 16 |
+                (nxt_word_t)buf[i * 4 + 3] << 24;
+
+  // Started, done, errors.
+  if (status[0] > (nxt_word_t)job->started || status[1] > status[0])
+    return NXT_ERROR_PROTO;
+
+  // Erase All is done before the first page.
+  if (status[1] > 0 && job->erase_pending)
+    {
+      job->journal.erased = true;
+      job->erase_pending = false;
+    }
+  for (; job->confirmed < (int)status[1]; job->confirmed++)
+    job->journal.done[job->list[job->confirmed]] = true;
+
+  // Nothing is started after an error.
+  if (status[2])
+    return NXT_FLASH_FAILED;
+  if (status[0] != (nxt_word_t)job->started)
+    return NXT_ERROR_PROTO;
+
+  return NXT_OK;
 }
 
 static nxt_error_t
-nxt_firmware_validate_fd(int fd)
+nxt_flash_finish(nxt_flash_job_t *job)
 {
-  struct stat s;
-  uint8_t vectors[6 * 4];
+  // The flash routine does not wait for the last command, an empty batch
+  // waits for it and confirms all pages.
+  NXT_ERR(nxt_flash_batch(job, NULL, 0, false, false));
+  NXT_ERR(nxt_flash_confirm(job));
+  if (job->confirmed != job->started)
+    return NXT_ERROR_PROTO;
 
-  if (fstat(fd, &s) < 0)
-    return NXT_FILE_ERROR;
+  job->journal.erased = job->journal.erased || job->erase_pending;
+  job->erase_pending = false;
 
-  if (s.st_size != 256 * 1024)
-    return NXT_INVALID_FIRMWARE;
+  return NXT_OK;
+}
+
+static nxt_error_t
+nxt_flash_save_journal(nxt_flash_job_t *job)
+{
+  if (!job->journal_path)
+    return NXT_OK;
 
-  if (read(fd, vectors, sizeof(vectors)) != sizeof(vectors))
-    return NXT_FILE_ERROR;
+  return nxt_journal_save(&job->journal, job->journal_path);
+}
 
-  // Does it looks like ARM vectors?
-  for (int i = 0; i < 6; i++)
+static nxt_error_t
+nxt_flash_run_batches(nxt_flash_job_t *job)
+{
+  int *list = job->list;
+  int todo = 0, done = 0;
+  unsigned long bytes, bytes_total;
+  nxt_error_t err;
+
+  // Erasing loses previously programmed pages.
+  job->erase_pending = job->erase_all && !job->journal.erased;
+  if (job->erase_pending)
+    memset(job->journal.done, 0, sizeof(job->journal.done));
+
+  for (int i = 0; i < NXT_FLASH_PAGES; i++)
     {
-      uint32_t v = vectors[i * 4] | vectors[i * 4 + 1] << 8 |
-                   vectors[i * 4 + 2] << 16 | vectors[i * 4 + 3] << 24;
-      if (v != 0xe1a00000                   // nop
-          && v != 0xeafffffe                // branch here (-4)
-          && (v & 0xffff0000) != 0xea000000 // branch forward
-          && (v & 0xfffff000) != 0xe59ff000 // ldr pc, [pc, #xx]
-      )
-        return NXT_INVALID_FIRMWARE;
+      if (job->program[i] && !job->journal.done[i])
+        list[todo++] = i;
+      else if (job->program[i])
+        done++;
+    }
+
+  bytes_total = flash_len;
+  for (int i = 0; i == 0 || i < todo; i += NXT_FLASH_BATCH_PAGES)
+    {
+      int count = todo - i;
+      if (count > NXT_FLASH_BATCH_PAGES)
+        count = NXT_FLASH_BATCH_PAGES;
+      bytes_total += NXT_FLASH_BATCH_SIZE(count);
+    }
+  nxt_progress_start(&job->progress, job->progress_cb, job->progress_user,
+                     bytes_total, done + todo);
+
+  NXT_ERR(nxt_flash_prepare(job));
+  bytes = flash_len;
+
+  // Unlock, erase and lock are done by the flash routine with the first
+  // and last batches, there is always at least one batch.
+  for (int i = 0; i == 0 || i < todo; i += NXT_FLASH_BATCH_PAGES)
+    {
+      int count = todo - i;
+      if (count > NXT_FLASH_BATCH_PAGES)
+        count = NXT_FLASH_BATCH_PAGES;
+      NXT_ERR(nxt_flash_batch(job, list + i, count, i == 0,
+                              i + count == todo));
+
+      // Pages are only marked as done once the flash routine confirmed
+      // them, a page left unconfirmed is programmed again on resume. The
+      // last batch is confirmed when finishing.
+      if (i + count < todo)
+        {
+          err = nxt_flash_confirm(job);
+          if (err == NXT_OK)
+            err = nxt_flash_save_journal(job);
+          NXT_ERR(err);
+        }
+
+      // On cancellation, let the flash controller finish its work, the
+      // journal can be used to continue later.
+      bytes += NXT_FLASH_BATCH_SIZE(count);
+      err = nxt_progress_update(&job->progress, bytes, done + i + count);
+      if (err == NXT_CANCELLED)
+        NXT_ERR(nxt_flash_finish(job));
+      NXT_ERR(err);
     }
 
-  if (lseek(fd, 0, SEEK_SET) < 0)
-    return NXT_FILE_ERROR;
+  return nxt_flash_finish(job);
+}
+
+static nxt_error_t
+nxt_flash_run(nxt_flash_job_t *job)
+{
+  nxt_error_t err;
+
+  // Allocated for each run, as the connection changes on reconnection.
+  NXT_ERR(nxt_samba_buf_alloc(job->nxt, &job->batch,
+                              NXT_FLASH_BATCH_SIZE(NXT_FLASH_BATCH_PAGES)));
+  err = nxt_flash_run_batches(job);
+  nxt_samba_buf_free(job->nxt, &job->batch);
+
+  // Keep confirmed pages for a later resume, the error is more useful than
+  // a failure to save.
+  if (err != NXT_OK)
+    nxt_flash_save_journal(job);
+
+  return err;
+}
+
+static nxt_error_t
+nxt_flash_compare(nxt_t *nxt, const nxt_image_t *image,
+                  const nxt_manifest_t *manifest, bool *pages, bool *erased)
+{
+  uint32_t crcs[NXT_FLASH_PAGES];
+  uint8_t blank[NXT_FLASH_PAGE_SIZE];
+  uint32_t blank_crc;
+
+  memset(blank, 0xff, sizeof(blank));
+  blank_crc = nxt_crc32(0, blank, sizeof(blank));
+
+  // Compute CRC of flash pages on the brick, and compare them to the
+  // image, no need to read back the whole flash.
+  NXT_ERR(nxt_crc32_remote_load(nxt, NXT_FLASH_CRC_ADDR));
+  NXT_ERR(nxt_crc32_remote(nxt, NXT_FLASH_CRC_ADDR, NXT_FLASH_ADDR,
+                           NXT_FLASH_PAGE_SIZE, image->pages, crcs));
+  for (int i = 0; i < image->pages; i++)
+    {
+      const uint8_t *data = image->data + i * NXT_FLASH_PAGE_SIZE;
+      uint32_t crc;
+
+      // Use precomputed CRC if available.
+      if (manifest)
+        crc = manifest->page_crc[i];
+      else
+        crc = nxt_crc32(0, data, NXT_FLASH_PAGE_SIZE);
+      pages[i] = image->populated[i] && crcs[i] != crc;
+      if (erased)
+        erased[i] = crcs[i] == blank_crc;
+    }
 
   return NXT_OK;
 }
@@ -106,59 +365,311 @@ nxt_firmware_validate_fd(int fd)
 nxt_error_t
 nxt_firmware_validate(const char *fw_path)
 {
+  nxt_image_t *image;
+
+  NXT_ERR(nxt_image_load(&image, fw_path));
+  nxt_image_free(image);
+
+  return NXT_OK;
+}
+
+nxt_error_t
+nxt_firmware_flash_image(nxt_t *nxt, const nxt_image_t *image,
+                         const nxt_firmware_options_t *options,
+                         nxt_firmware_stats_t *stats)
+{
+  static const nxt_firmware_options_t default_options = { 0 };
+  nxt_flash_job_t job = { 0 };
+  nxt_journal_t saved;
+  int todo = 0, populated = 0, last_page;
   nxt_error_t err;
-  int fd;
+  double start;
+
+  if (!options)
+    options = &default_options;
+
+  job.nxt = nxt;
+  job.image = image;
+  job.profile = options->profile ? options->profile : nxt_flash_profile(NULL);
+  job.relock = options->relock;
+  job.progress_cb = options->progress;
+  job.progress_user = options->progress_user;
+
+  // Refuse to touch pages outside of the allowed range.
+  last_page = options->page_count ? options->first_page + options->page_count
+                                  : NXT_FLASH_PAGES;
+  if (options->first_page < 0 || options->page_count < 0 ||
+      last_page > NXT_FLASH_PAGES)
+    return NXT_INVALID_FIRMWARE;
+  for (int i = 0; i < image->pages; i++)
+    {
+      if (image->populated[i] && (i < options->first_page || i >= last_page))
+        return NXT_INVALID_FIRMWARE;
+    }
+
+  if (options->delta)
+    NXT_ERR(nxt_flash_compare(nxt, image, options->manifest, job.program,
+                              job.erased));
+  else
+    {
+      // When the image covers the whole flash, erase it first, then blank
+      // pages can be skipped. Else, only write populated pages.
+      job.erase_all = image->pages == NXT_FLASH_PAGES;
+      for (int i = 0; i < NXT_FLASH_PAGES; i++)
+        job.erase_all = job.erase_all && image->populated[i];
+      for (int i = 0; i < image->pages; i++)
+        {
+          bool blank = options->manifest
+                           ? nxt_manifest_page_blank(options->manifest, i)
+                           : nxt_image_page_blank(image, i);
+          job.program[i] = image->populated[i] && !(job.erase_all && blank);
+          job.erased[i] = job.erase_all;
+        }
+    }
+
+  for (int i = 0; i < NXT_FLASH_PAGES; i++)
+    {
+      todo += job.program[i];
+      populated += image->populated[i];
+    }
+  if (stats)
+    {
+      stats->pages_written = todo;
+      stats->pages_skipped = populated - todo;
+      stats->pages_reprogrammed = 0;
+      stats->seconds = 0.0;
+    }
+  if (!todo && !job.erase_all)
+    return NXT_OK;
+
+  // Resume from journal if it was written for the same brick and image.
+  if (options->journal)
+    {
+      NXT_ERR(nxt_get_port_path(nxt, job.journal.key,
+                                sizeof(job.journal.key)));
+      job.journal.digest = options->manifest ? options->manifest->digest
+                                             : nxt_journal_digest(image);
+      job.journal_path = options->journal;
+      if (nxt_journal_load(&saved, options->journal) == NXT_OK
+          && strcmp(saved.key, job.journal.key) == 0
+          && saved.digest == job.journal.digest)
+        {
+          job.journal = saved;
+          // Pages which were not confirmed may be partially programmed.
+          memset(job.erased, 0, sizeof(job.erased));
+        }
+    }
 
-  fd = open(fw_path, O_RDONLY);
-  if (fd < 0)
-    return NXT_FILE_ERROR;
+  start = nxt_progress_time();
 
-  err = nxt_firmware_validate_fd(fd);
-  close(fd);
+  // On USB error or timeout, reconnect and continue from the last confirmed
+  // page.
+  for (int attempt = 0;; attempt++)
+    {
+      err = nxt_flash_run(&job);
+      if (err == NXT_OK)
+        break;
+      if ((err < NXT_ERROR_USB_MIN && err != NXT_TIMEOUT)
+          || attempt >= options->retries)
+        return err;
+      memset(job.erased, 0, sizeof(job.erased));
+      NXT_ERR(nxt_reconnect(nxt));
+      NXT_ERR(nxt_handshake(nxt));
+    }
 
-  return err;
+  // Read back and program again the pages which do not match.
+  if (options->verify)
+    {
+      bool mismatch[NXT_FLASH_PAGES];
+      int count;
+
+      NXT_ERR(nxt_firmware_verify(nxt, image, mismatch, &count));
+      if (stats)
+        stats->pages_reprogrammed = count;
+      if (count)
+        {
+          for (int i = 0; i < NXT_FLASH_PAGES; i++)
+            {
+              job.program[i] = mismatch[i];
+              job.erased[i] = false;
+              job.journal.done[i] = job.journal.done[i] && !mismatch[i];
+            }
+          job.erase_all = false;
+          NXT_ERR(nxt_flash_run(&job));
+          NXT_ERR(nxt_firmware_verify(nxt, image, mismatch, &count));
+          if (count)
+            return NXT_VERIFY_FAILED;
+        }
+    }
+
+  if (stats)
+    stats->seconds = nxt_progress_time() - start;
+
+  // Done, the journal is not needed anymore.
+  if (job.journal_path)
+    nxt_journal_remove(job.journal_path);
+
+  return NXT_OK;
 }
 
 nxt_error_t
 nxt_firmware_flash(nxt_t *nxt, const char *fw_path)
 {
-  int fd, i, err;
+  nxt_image_t *image;
+  nxt_error_t err;
+
+  NXT_ERR(nxt_image_load(&image, fw_path));
+  err = nxt_firmware_flash_image(nxt, image, NULL, NULL);
+  nxt_image_free(image);
+
+  return err;
+}
+
+nxt_error_t
+nxt_firmware_verify(nxt_t *nxt, const nxt_image_t *image, bool *pages,
+                    int *mismatches)
+{
+  nxt_samba_buf_t buf;
+  nxt_error_t err = NXT_OK;
+  int i = 0, count;
 
-  fd = open(fw_path, O_RDONLY);
-  if (fd < 0)
-    return NXT_FILE_ERROR;
+  NXT_ERR(nxt_samba_buf_alloc(nxt, &buf,
+                              NXT_FLASH_READ_PAGES * NXT_FLASH_PAGE_SIZE));
 
-  err = nxt_firmware_validate_fd(fd);
-  if (err != NXT_OK)
+  *mismatches = 0;
+  memset(pages, 0, NXT_FLASH_PAGES * sizeof(*pages));
+
+  // Read runs of populated pages, as large as possible.
+  while (i < image->pages && err == NXT_OK)
     {
-      close(fd);
-      return NXT_INVALID_FIRMWARE;
+      if (!image->populated[i])
+        {
+          i++;
+          continue;
+        }
+      for (count = 1; count < NXT_FLASH_READ_PAGES && i + count < image->pages
+                      && image->populated[i + count];
+           count++)
+        ;
+      err = nxt_recv_samba_buf(nxt, NXT_FLASH_ADDR + i * NXT_FLASH_PAGE_SIZE,
+                               &buf, count * NXT_FLASH_PAGE_SIZE);
+      for (int j = 0; j < count && err == NXT_OK; j++)
+        {
+          pages[i + j] = memcmp(buf.data + j * NXT_FLASH_PAGE_SIZE,
+                                image->data + (i + j) * NXT_FLASH_PAGE_SIZE,
+                                NXT_FLASH_PAGE_SIZE)
+                         != 0;
+          *mismatches += pages[i + j];
+        }
+      i += count;
     }
 
-  NXT_ERR(nxt_flash_prepare(nxt));
+  nxt_samba_buf_free(nxt, &buf);
+  return err;
+}
+
+nxt_error_t
+nxt_firmware_flash_fd(nxt_t *nxt, int fd)
+{
+  nxt_image_t *image;
+  nxt_error_t err;
+
+  NXT_ERR(nxt_image_load_fd(&image, fd, 0));
+  err = nxt_image_validate(image);
+  if (err == NXT_OK)
+    err = nxt_firmware_flash_image(nxt, image, NULL, NULL);
+  nxt_image_free(image);
 
-  for (i = 0; i < 1024; i++)
+  return err;
+}
+
+nxt_error_t
+nxt_firmware_flash_buffer(nxt_t *nxt, const uint8_t *buf, size_t len)
+{
+  nxt_image_t *image;
+  nxt_error_t err;
+
+  NXT_ERR(nxt_image_load_buffer(&image, buf, len, 0));
+  err = nxt_image_validate(image);
+  if (err == NXT_OK)
+    err = nxt_firmware_flash_image(nxt, image, NULL, NULL);
+  nxt_image_free(image);
+
+  return err;
+}
+
+nxt_error_t
+nxt_firmware_check(nxt_t *nxt, const nxt_image_t *image,
+                   const nxt_manifest_t *manifest)
+{
+  bool pages[NXT_FLASH_PAGES];
+
+  NXT_ERR(nxt_flash_compare(nxt, image, manifest, pages, NULL));
+  for (int i = 0; i < image->pages; i++)
     {
-      uint8_t buf[256];
-      int ret;
+      if (pages[i])
+        return NXT_VERIFY_FAILED;
+    }
 
-      memset(buf, 0, 256);
-      ret = read(fd, buf, 256);
+  return NXT_OK;
+}
 
-      if (ret != -1)
-        NXT_ERR(nxt_flash_block(nxt, i, buf));
+nxt_error_t
+nxt_firmware_boot(nxt_t *nxt, double timeout, nxt_firmware_boot_t *boot)
+{
+  char path[NXT_PORT_PATH_SIZE];
+  const struct timespec poll = { 0, 50000000 };
+  nxt_device_info_t device_info;
+  double start, now;
+  nxt_error_t err;
 
-      if (ret < 256)
+  // The new firmware shows up on the same port.
+  NXT_ERR(nxt_get_port_path(nxt, path, sizeof(path)));
+  NXT_ERR(nxt_jump(nxt, NXT_FLASH_ADDR));
+  start = nxt_progress_time();
+  nxt_close(nxt);
+
+  memset(boot, 0, sizeof(*boot));
+  boot->firmware = N_FIRMWARES;
+
+  do
+    {
+      // Wait for the device to show up again, events are used when
+      // possible.
+      now = nxt_progress_time() - start;
+      err = nxt_wait(nxt, N_FIRMWARES, path, timeout - now);
+      if (err != NXT_OK)
+        break;
+      now = nxt_progress_time() - start;
+
+      // SAM-BA may still be seen for a short time, wait for it to leave.
+      if (nxt_is_firmware(nxt, SAMBA))
+        {
+          nxt_close(nxt);
+          err = nxt_wait_gone(nxt, SAMBA, path, timeout - now);
+          if (err != NXT_OK)
+            break;
+          continue;
+        }
+      if (boot->firmware == N_FIRMWARES)
         {
-          close(fd);
-          NXT_ERR(nxt_flash_finish(nxt));
+          boot->firmware = nxt_is_firmware(nxt, LEGO) ? LEGO : NXTOS;
+          boot->enumerated = now;
+        }
 
-          return ret == -1 ? NXT_FILE_ERROR : NXT_OK;
+      // Ready when it answers, only the LEGO firmware protocol is known.
+      err = nxt_open(nxt);
+      if (err == NXT_OK && boot->firmware == LEGO)
+        err = nxt_cmd_get_device_info(nxt, &device_info);
+      if (err == NXT_OK)
+        {
+          boot->ready = nxt_progress_time() - start;
+          return NXT_OK;
         }
+      nxt_close(nxt);
+      nanosleep(&poll, NULL);
     }
+  while (now < timeout);
 
-  close(fd);
-  NXT_ERR(nxt_flash_finish(nxt));
-
-  return NXT_OK;
+  return NXT_NOT_PRESENT;
 }
@@ -22,10 +22,74 @@
 #ifndef __FIRMWARE_H__
 #define __FIRMWARE_H__
 
+#include <stdbool.h>
+
 #include "error.h"
+#include "flash.h"
+#include "image.h"
 #include "lowlevel.h"
+#include "manifest.h"
+
+typedef struct
+{
+  /* Compare with flash content and only program pages which differ. */
+  bool delta;
+  /* Programming profile, or NULL for default. */
+  const nxt_flash_profile_t *profile;
+  /* Lock programmed regions after programming. */
+  bool relock;
+  /* Range of pages which can be programmed, page_count 0 means up to the
+   * end of flash. Image must not contain data outside this range. */
+  int first_page;
+  int page_count;
+  /* Journal file used to resume an interrupted flashing, or NULL. */
+  const char *journal;
+  /* Number of reconnections to try on USB error. */
+  int retries;
+  /* Read back flash after programming, and program again pages which do
+   * not match. */
+  bool verify;
+  /* Precomputed image information, or NULL. */
+  const nxt_manifest_t *manifest;
+  /* Progress callback, can be used to cancel flashing, or NULL. */
+  nxt_progress_cb_t progress;
+  void *progress_user;
+} nxt_firmware_options_t;
+
+typedef struct
+{
+  /* Number of programmed pages. */
+  int pages_written;
+  /* Number of pages in image which did not need programming. */
+  int pages_skipped;
+  /* Number of pages programmed again after verification. */
+  int pages_reprogrammed;
+  /* Time spent programming, in seconds. */
+  double seconds;
+} nxt_firmware_stats_t;
+
+typedef struct
+{
+  /* Firmware found after boot, LEGO or NXTOS. */
+  nxt_firmware firmware;
+  /* Time from jump to USB enumeration, and to first answer, in seconds. */
+  double enumerated;
+  double ready;
+} nxt_firmware_boot_t;
 
 nxt_error_t nxt_firmware_flash(nxt_t *nxt, const char *fw_path);
+nxt_error_t nxt_firmware_flash_fd(nxt_t *nxt, int fd);
+nxt_error_t nxt_firmware_flash_buffer(nxt_t *nxt, const uint8_t *buf,
+                                      size_t len);
+nxt_error_t nxt_firmware_flash_image(nxt_t *nxt, const nxt_image_t *image,
+                                     const nxt_firmware_options_t *options,
+                                     nxt_firmware_stats_t *stats);
 nxt_error_t nxt_firmware_validate(const char *fw_path);
+nxt_error_t nxt_firmware_verify(nxt_t *nxt, const nxt_image_t *image,
+                                bool *pages, int *mismatches);
+nxt_error_t nxt_firmware_boot(nxt_t *nxt, double timeout,
+                              nxt_firmware_boot_t *boot);
+nxt_error_t nxt_firmware_check(nxt_t *nxt, const nxt_image_t *image,
+                               const nxt_manifest_t *manifest);
 
 #endif /* __FIRMWARE_H__ */
@@ -19,49 +19,132 @@
  * USA
  */
 
+#include <string.h>
+
 #include "flash.h"
 
 #include "samba.h"
 
+#define NXT_FLASH_FMR(fmcn, fws) ((nxt_word_t)(fmcn) << 16 | (fws) << 8)
+
 enum nxt_flash_commands
 {
   FLASH_CMD_LOCK = 0x2,
   FLASH_CMD_UNLOCK = 0x4,
 };
 
+static const nxt_flash_profile_t nxt_flash_profiles[] = {
+  /* Values used since the first version, FMCN is lower than required by
+   * the datasheet, but this is known to work. */
+  { "default", 0x7, 1, 0x05, 0x34, false },
+  /* FMCN from datasheet: number of cycles in 1 us for NVM bits, and 1.5 us
+   * for other commands, at 48 MHz. */
+  { "safe", 0x7, 1, 48, 72, false },
+  /* Same as safe, but do not erase pages which are known to be erased
+   * before programming them. */
+  { "fast", 0x7, 1, 48, 72, true },
+};
+
+const nxt_flash_profile_t *
+nxt_flash_profile(const char *name)
+{
+  size_t n = sizeof(nxt_flash_profiles) / sizeof(nxt_flash_profiles[0]);
+
+  if (!name)
+    return &nxt_flash_profiles[0];
+
+  for (size_t i = 0; i < n; i++)
+    {
+      if (strcmp(nxt_flash_profiles[i].name, name) == 0)
+        return &nxt_flash_profiles[i];
+    }
+
+  return NULL;
+}
+
+nxt_word_t
+nxt_flash_profile_fmr_nvm(const nxt_flash_profile_t *profile)
+{
+  return NXT_FLASH_FMR(profile->fmcn_nvm, profile->fws);
+}
+
+nxt_word_t
+nxt_flash_profile_fmr_write(const nxt_flash_profile_t *profile)
+{
+  return NXT_FLASH_FMR(profile->fmcn_write, profile->fws);
+}
+
 nxt_error_t
-nxt_flash_wait_ready(nxt_t *nxt)
+nxt_flash_setup(nxt_t *nxt, const nxt_flash_profile_t *profile)
 {
-  nxt_word_t flash_status;
+  /* Master clock register, PLL/2 in all profiles. */
+  return nxt_write_word(nxt, 0xFFFFFC30, profile->mckr);
+}
 
+static nxt_error_t
+nxt_flash_wait_status(nxt_t *nxt, nxt_word_t *flash_status)
+{
   do
     {
-      NXT_ERR(nxt_read_word(nxt, 0xFFFFFF68, &flash_status));
+      NXT_ERR(nxt_read_word(nxt, 0xFFFFFF68, flash_status));
 
       /* Bit 0 is the FRDY field. Set to 1 if the flash controller is
        * ready to run a new command.
        */
     }
-  while (!(flash_status & 0x1));
+  while (!(*flash_status & 0x1));
 
   return NXT_OK;
 }
 
-static nxt_error_t
-nxt_flash_alter_lock(nxt_t *nxt, int region_num, enum nxt_flash_commands cmd)
+nxt_error_t
+nxt_flash_wait_ready(nxt_t *nxt)
 {
-  nxt_word_t w = 0x5A000000 | ((64 * region_num) << 8);
-  w += cmd;
+  nxt_word_t flash_status;
 
-  NXT_ERR(nxt_flash_wait_ready(nxt));
+  return nxt_flash_wait_status(nxt, &flash_status);
+}
 
-  /* Flash mode register: FCMN 0x5, FWS 0x1
-   * Flash command register: KEY 0x5A, FCMD = clear-lock-bit (0x4)
-   * Flash mode register: FCMN 0x34, FWS 0x1
+static nxt_error_t
+nxt_flash_alter_lock(nxt_t *nxt, uint16_t regions, enum nxt_flash_commands cmd,
+                     const nxt_flash_profile_t *profile)
+{
+  nxt_word_t flash_status;
+  uint16_t locked;
+  int i;
+
+  /* Bits 16 to 31 of the flash status register are the LOCKS fields. Only
+   * change regions which are not already in the requested state.
    */
-  NXT_ERR(nxt_write_word(nxt, 0xFFFFFF60, 0x00050100));
-  NXT_ERR(nxt_write_word(nxt, 0xFFFFFF64, w));
-  NXT_ERR(nxt_write_word(nxt, 0xFFFFFF60, 0x00340100));
+  NXT_ERR(nxt_flash_wait_status(nxt, &flash_status));
+  locked = flash_status >> 16;
+  if (cmd == FLASH_CMD_LOCK)
+    regions &= ~locked;
+  else
+    regions &= locked;
+  if (!regions)
+    return NXT_OK;
+
+  /* Flash mode register: FCMN for NVM bits */
+  NXT_ERR(nxt_write_word(nxt, 0xFFFFFF60, nxt_flash_profile_fmr_nvm(profile)));
+
+  for (i = 0; i < 16; i++)
+    {
+      if (regions & (1 << i))
+        {
+          /* Flash command register: KEY 0x5A, FCMD = set/clear-lock-bit
+           * (0x2/0x4), PAGEN = first page of region
+           */
+          NXT_ERR(nxt_flash_wait_ready(nxt));
+          NXT_ERR(nxt_write_word(nxt, 0xFFFFFF64,
+                                 0x5A000000 | ((64 * i) << 8) | cmd));
+        }
+    }
+
+  /* Flash mode register: FCMN for writes */
+  NXT_ERR(nxt_flash_wait_ready(nxt));
+  NXT_ERR(
+      nxt_write_word(nxt, 0xFFFFFF60, nxt_flash_profile_fmr_write(profile)));
 
   return NXT_OK;
 }
@@ -69,33 +152,27 @@ nxt_flash_alter_lock(nxt_t *nxt, int region_num, enum nxt_flash_commands cmd)
 nxt_error_t
 nxt_flash_lock_region(nxt_t *nxt, int region_num)
 {
-  return nxt_flash_alter_lock(nxt, region_num, FLASH_CMD_LOCK);
+  return nxt_flash_alter_lock(nxt, 1 << region_num, FLASH_CMD_LOCK,
+                              nxt_flash_profile(NULL));
 }
 
 nxt_error_t
 nxt_flash_unlock_region(nxt_t *nxt, int region_num)
 {
-  return nxt_flash_alter_lock(nxt, region_num, FLASH_CMD_UNLOCK);
+  return nxt_flash_alter_lock(nxt, 1 << region_num, FLASH_CMD_UNLOCK,
+                              nxt_flash_profile(NULL));
 }
 
 nxt_error_t
 nxt_flash_lock_all_regions(nxt_t *nxt)
 {
-  int i;
-
-  for (i = 0; i < 16; i++)
-    NXT_ERR(nxt_flash_lock_region(nxt, i));
-
-  return NXT_OK;
+  return nxt_flash_alter_lock(nxt, 0xffff, FLASH_CMD_LOCK,
+                              nxt_flash_profile(NULL));
 }
 
 nxt_error_t
 nxt_flash_unlock_all_regions(nxt_t *nxt)
 {
-  int i;
-
-  for (i = 0; i < 16; i++)
-    NXT_ERR(nxt_flash_unlock_region(nxt, i));
-
-  return NXT_OK;
+  return nxt_flash_alter_lock(nxt, 0xffff, FLASH_CMD_UNLOCK,
+                              nxt_flash_profile(NULL));
 }
@@ -22,9 +22,34 @@
 #ifndef __FLASH_H__
 #define __FLASH_H__
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "error.h"
 #include "lowlevel.h"
+#include "samba.h"
+
+/* Flash programming profile, clock and flash controller timings. */
+typedef struct
+{
+  const char *name;
+  /* Master clock register value. */
+  nxt_word_t mckr;
+  /* Flash wait states. */
+  int fws;
+  /* Flash microsecond cycle number, for NVM bits and for other
+   * commands. */
+  int fmcn_nvm;
+  int fmcn_write;
+  /* Program pages known to be erased without erasing them first. */
+  bool nebp;
+} nxt_flash_profile_t;
+
+const nxt_flash_profile_t *nxt_flash_profile(const char *name);
+nxt_word_t nxt_flash_profile_fmr_nvm(const nxt_flash_profile_t *profile);
+nxt_word_t nxt_flash_profile_fmr_write(const nxt_flash_profile_t *profile);
 
+nxt_error_t nxt_flash_setup(nxt_t *nxt, const nxt_flash_profile_t *profile);
 nxt_error_t nxt_flash_wait_ready(nxt_t *nxt);
 nxt_error_t nxt_flash_lock_region(nxt_t *nxt, int region_num);
 nxt_error_t nxt_flash_unlock_region(nxt_t *nxt, int region_num);
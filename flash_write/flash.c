@@ -22,28 +22,154 @@
 #define VINTPTR(addr) ((volatile unsigned int *)(addr))
 #define VINT(addr) (*(VINTPTR(addr)))
 
-#define USER_PAGE VINTPTR(0x00202100)
-#define USER_PAGE_NUM VINT(0x00202300)
+/* Batch descriptor, written by the host in a single transfer:
+ *  - flash mode register value for programming,
+ *  - flash mode register value for NVM bits,
+ *  - regions to unlock before programming, one bit per region,
+ *  - regions to lock after programming, one bit per region,
+ *  - flags,
+ *  - number of pages,
+ *  - page numbers, one word per page, with a flag for pages already erased,
+ *  - page data, 64 words per page.
+ */
+#define BATCH_DESC VINTPTR(0x00202400)
+#define BATCH_ERASE_ALL 0x1
+#define BATCH_PAGE_NO_ERASE 0x80000000
+
+/* Completion status, after the largest batch descriptor, cleared by the
+ * host after loading the routine:
+ *  - number of pages whose programming was started,
+ *  - number of pages confirmed to be programmed,
+ *  - flash controller errors, nothing is done once set.
+ */
+#define STATUS VINTPTR(0x00204600)
+#define STATUS_STARTED 0
+#define STATUS_DONE 1
+#define STATUS_ERRORS 2
 
 #define FLASH_BASE VINTPTR(0x00100000)
+#define FLASH_MODE_REG VINT(0xFFFFFF60)
+#define FLASH_MODE_NEBP 0x80
 #define FLASH_CMD_REG VINT(0xFFFFFF64)
 #define FLASH_STATUS_REG VINT(0xFFFFFF68)
-#define OFFSET_PAGE_NUM ((USER_PAGE_NUM & 0x000003FF) << 8)
-#define FLASH_CMD_WRITE (0x5A000001 + OFFSET_PAGE_NUM)
+#define FLASH_STATUS_FRDY 0x1
+#define FLASH_STATUS_ERRORS 0xC
+#define FLASH_CMD_WRITE(page) (0x5A000001 + (((page) & 0x000003FF) << 8))
+#define FLASH_CMD_LOCK(region) (0x5A000002 + (((region) & 0xF) << 14))
+#define FLASH_CMD_UNLOCK(region) (0x5A000004 + (((region) & 0xF) << 14))
+#define FLASH_CMD_ERASE_ALL 0x5A000008
+
+static void
+wait_ready(void)
+{
+  volatile unsigned int *status = STATUS;
+  unsigned int fsr;
+
+  /* Error bits are cleared on read, keep them. */
+  do
+    {
+      fsr = FLASH_STATUS_REG;
+      status[STATUS_ERRORS] |= fsr & FLASH_STATUS_ERRORS;
+    }
+  while (!(fsr & FLASH_STATUS_FRDY));
+
+  /* All started pages are done, confirm them unless there was an error. */
+  if (!status[STATUS_ERRORS])
+    status[STATUS_DONE] = status[STATUS_STARTED];
+}
+
+static void
+alter_locks(unsigned int regions, unsigned int lock)
+{
+  unsigned int i;
+
+  /* Lock status is in the upper half of the status register, only change
+   * regions which need it. */
+  wait_ready();
+  if (lock)
+    regions &= ~(FLASH_STATUS_REG >> 16);
+  else
+    regions &= FLASH_STATUS_REG >> 16;
+
+  for (i = 0; i < 16; i++)
+    {
+      if (regions & (1 << i))
+        {
+          wait_ready();
+          FLASH_CMD_REG = lock ? FLASH_CMD_LOCK(i) : FLASH_CMD_UNLOCK(i);
+        }
+    }
+}
 
 void
 do_flash_write(void)
 {
-  unsigned long i;
+  volatile unsigned int *desc = BATCH_DESC;
+  unsigned int mode = desc[0];
+  unsigned int nvm_mode = desc[1];
+  unsigned int unlock = desc[2];
+  unsigned int lock = desc[3];
+  unsigned int flags = desc[4];
+  unsigned int count = desc[5];
+  volatile unsigned int *pages = desc + 6;
+  volatile unsigned int *data = pages + count;
+  volatile unsigned int *status = STATUS;
+  unsigned long i, n;
+
+  /* Wait for the previous command, this confirms pages programmed so far
+   * even for an empty batch. */
+  wait_ready();
+  if (status[STATUS_ERRORS])
+    return;
+
+  if (unlock)
+    {
+      wait_ready();
+      FLASH_MODE_REG = nvm_mode;
+      alter_locks(unlock, 0);
+      wait_ready();
+      FLASH_MODE_REG = mode;
+    }
+
+  if (flags & BATCH_ERASE_ALL)
+    {
+      wait_ready();
+      FLASH_MODE_REG = mode;
+      FLASH_CMD_REG = FLASH_CMD_ERASE_ALL;
+    }
+
+  for (n = 0; n < count; n++)
+    {
+      unsigned int page = pages[n] & 0x000003FF;
+
+      /* Wait for the previous command. */
+      wait_ready();
+      if (status[STATUS_ERRORS])
+        return;
+
+      if (pages[n] & BATCH_PAGE_NO_ERASE)
+        FLASH_MODE_REG = mode | FLASH_MODE_NEBP;
+      else
+        FLASH_MODE_REG = mode;
 
-  while (!(FLASH_STATUS_REG & 0x1))
-    ;
+      for (i = 0; i < 64; i++)
+        FLASH_BASE[(page * 64) + i] = data[i];
+      data += 64;
 
-  for (i = 0; i < 64; i++)
-    FLASH_BASE[(USER_PAGE_NUM * 64) + i] = USER_PAGE[i];
+      FLASH_CMD_REG = FLASH_CMD_WRITE(page);
+      status[STATUS_STARTED]++;
+    }
 
-  FLASH_CMD_REG = FLASH_CMD_WRITE;
+  if (lock)
+    {
+      wait_ready();
+      FLASH_MODE_REG = nvm_mode;
+      alter_locks(lock, 1);
+      wait_ready();
+      FLASH_MODE_REG = mode;
+    }
 
-  while (!(FLASH_STATUS_REG & 0x1))
-    ;
+  /* Do not wait for the last page to be programmed. Data is already in the
+   * flash controller latch buffer, so the host can send the next batch in
+   * the meantime. Readiness is checked before the next command. */
 }
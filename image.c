@@ -0,0 +1,536 @@
+/**
+ * NXT bootstrap interface; NXT firmware image handling code.
+ *
+ * Copyright 2006 David Anderson <dave@natulte.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+
+/* Reading input, initial buffer size when the size is unknown, and maximum
+ * input size, which is large to accept ELF files with debug information. */
+#define NXT_IMAGE_STREAM_CHUNK 0x10000
+#define NXT_IMAGE_STREAM_MAX 0x4000000
+
+static uint16_t
+get_hword(const uint8_t *p)
+{
+  return p[0] | p[1] << 8;
+}
+
+static uint32_t
+get_word(const uint8_t *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static nxt_error_t
+nxt_image_write(nxt_image_t *image, uint32_t addr, const uint8_t *buf,
+                size_t len)
+{
+  uint32_t offset = addr - NXT_FLASH_ADDR;
+
+  if (!len)
+    return NXT_OK;
+
+  // Only accept data for the flash memory.
+  if (addr < NXT_FLASH_ADDR || offset >= NXT_FLASH_SIZE ||
+      len > NXT_FLASH_SIZE - offset)
+    return NXT_INVALID_FIRMWARE;
+
+  memcpy(image->storage + offset, buf, len);
+  for (size_t i = offset / NXT_FLASH_PAGE_SIZE;
+       i <= (offset + len - 1) / NXT_FLASH_PAGE_SIZE; i++)
+    image->populated[i] = true;
+
+  return NXT_OK;
+}
+
+static nxt_error_t
+nxt_image_parse_elf(nxt_image_t *image, const uint8_t *buf, size_t size)
+{
+  uint32_t phoff;
+  uint16_t phentsize, phnum;
+
+  // 32 bit, little endian, ARM.
+  if (size < 52 || buf[4] != 1 || buf[5] != 1 || get_hword(buf + 18) != 40)
+    return NXT_INVALID_FIRMWARE;
+
+  phoff = get_word(buf + 28);
+  phentsize = get_hword(buf + 42);
+  phnum = get_hword(buf + 44);
+  if (phentsize < 32)
+    return NXT_INVALID_FIRMWARE;
+
+  // Use loadable segments at their load address.
+  for (int i = 0; i < phnum; i++)
+    {
+      size_t ph = phoff + (size_t)i * phentsize;
+      uint32_t type, offset, paddr, filesz;
+
+      if (ph > size || size - ph < 32)
+        return NXT_INVALID_FIRMWARE;
+
+      type = get_word(buf + ph);
+      offset = get_word(buf + ph + 4);
+      paddr = get_word(buf + ph + 12);
+      filesz = get_word(buf + ph + 16);
+      if (type != 1 || !filesz)
+        continue;
+      if (offset > size || filesz > size - offset)
+        return NXT_INVALID_FIRMWARE;
+
+      NXT_ERR(nxt_image_write(image, paddr, buf + offset, filesz));
+    }
+
+  return NXT_OK;
+}
+
+static int
+hex_digit(uint8_t c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  else if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  else if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  else
+    return -1;
+}
+
+static nxt_error_t
+hex_decode(const uint8_t **p, const uint8_t *end, uint8_t *out, int n)
+{
+  if (end - *p < n * 2)
+    return NXT_INVALID_FIRMWARE;
+
+  for (int i = 0; i < n; i++)
+    {
+      int h = hex_digit((*p)[0]);
+      int l = hex_digit((*p)[1]);
+      if (h < 0 || l < 0)
+        return NXT_INVALID_FIRMWARE;
+      out[i] = h << 4 | l;
+      *p += 2;
+    }
+
+  return NXT_OK;
+}
+
+static const uint8_t *
+skip_space(const uint8_t *p, const uint8_t *end)
+{
+  while (p != end && (*p == '\r' || *p == '\n' || *p == ' ' || *p == '\t'))
+    p++;
+  return p;
+}
+
+static nxt_error_t
+nxt_image_parse_ihex(nxt_image_t *image, const uint8_t *buf, size_t size)
+{
+  const uint8_t *p = buf, *end = buf + size;
+  uint32_t base = 0;
+
+  while ((p = skip_space(p, end)) != end)
+    {
+      uint8_t rec[5 + 255];
+      uint8_t sum = 0;
+      int len;
+
+      // Record: length, address, type, data, checksum.
+      if (*p++ != ':')
+        return NXT_INVALID_FIRMWARE;
+      NXT_ERR(hex_decode(&p, end, rec, 1));
+      len = rec[0];
+      NXT_ERR(hex_decode(&p, end, rec + 1, 4 + len));
+      for (int i = 0; i < 5 + len; i++)
+        sum += rec[i];
+      if (sum)
+        return NXT_INVALID_FIRMWARE;
+
+      switch (rec[3])
+        {
+        case 0x00:
+          NXT_ERR(nxt_image_write(image, base + (rec[1] << 8 | rec[2]),
+                                  rec + 4, len));
+          break;
+        case 0x01:
+          // Only blank lines may follow the end of file record.
+          if (skip_space(p, end) != end)
+            return NXT_INVALID_FIRMWARE;
+          return NXT_OK;
+        case 0x02:
+          if (len != 2)
+            return NXT_INVALID_FIRMWARE;
+          base = (rec[4] << 8 | rec[5]) << 4;
+          break;
+        case 0x04:
+          if (len != 2)
+            return NXT_INVALID_FIRMWARE;
+          base = (uint32_t)(rec[4] << 8 | rec[5]) << 16;
+          break;
+        case 0x03:
+        case 0x05:
+          // Start address, ignored.
+          break;
+        default:
+          return NXT_INVALID_FIRMWARE;
+        }
+    }
+
+  return NXT_OK;
+}
+
+static nxt_error_t
+nxt_image_parse_srec(nxt_image_t *image, const uint8_t *buf, size_t size)
+{
+  const uint8_t *p = buf, *end = buf + size;
+
+  while ((p = skip_space(p, end)) != end)
+    {
+      uint8_t rec[1 + 255];
+      uint8_t sum = 0;
+      uint32_t addr = 0;
+      int type, len, addr_len;
+
+      // Record: type, count, address, data, checksum.
+      if (end - p < 2 || p[0] != 'S')
+        return NXT_INVALID_FIRMWARE;
+      type = hex_digit(p[1]);
+      p += 2;
+      NXT_ERR(hex_decode(&p, end, rec, 1));
+      len = rec[0];
+      NXT_ERR(hex_decode(&p, end, rec + 1, len));
+      for (int i = 0; i < 1 + len; i++)
+        sum += rec[i];
+      if (sum != 0xff)
+        return NXT_INVALID_FIRMWARE;
+
+      switch (type)
+        {
+        case 1:
+        case 2:
+        case 3:
+          addr_len = type + 1;
+          if (len < addr_len + 1)
+            return NXT_INVALID_FIRMWARE;
+          for (int i = 0; i < addr_len; i++)
+            addr = addr << 8 | rec[1 + i];
+          NXT_ERR(nxt_image_write(image, addr, rec + 1 + addr_len,
+                                  len - addr_len - 1));
+          break;
+        case 7:
+        case 8:
+        case 9:
+          if (skip_space(p, end) != end)
+            return NXT_INVALID_FIRMWARE;
+          return NXT_OK;
+        case 0:
+        case 5:
+        case 6:
+          // Header, record count, ignored.
+          break;
+        default:
+          return NXT_INVALID_FIRMWARE;
+        }
+    }
+
+  return NXT_OK;
+}
+
+static bool
+nxt_image_is_text(const uint8_t *buf, size_t size)
+{
+  for (size_t i = 0; i < size; i++)
+    {
+      if ((buf[i] < ' ' || buf[i] > '~') && buf[i] != '\r' &&
+          buf[i] != '\n' && buf[i] != '\t')
+        return false;
+    }
+  return true;
+}
+
+/* Use storage for image content, initially blank. */
+static nxt_error_t
+nxt_image_clear(nxt_image_t *image)
+{
+  if (!image->storage)
+    {
+      image->storage = malloc(NXT_FLASH_SIZE);
+      if (!image->storage)
+        return NXT_ERROR_NO_MEM;
+    }
+  memset(image->storage, 0xff, NXT_FLASH_SIZE);
+  memset(image->populated, 0, sizeof(image->populated));
+  image->data = image->storage;
+
+  return NXT_OK;
+}
+
+static nxt_error_t
+nxt_image_parse_text(nxt_image_t *image, const uint8_t *buf, size_t size)
+{
+  // Raw images can start like a record, an ARM branch can start with ':',
+  // only use a text format if the whole file is text and parses.
+  if (!size || !nxt_image_is_text(buf, size))
+    return NXT_INVALID_FIRMWARE;
+  NXT_ERR(nxt_image_clear(image));
+  if (buf[0] == ':')
+    return nxt_image_parse_ihex(image, buf, size);
+  if (size >= 2 && buf[0] == 'S' && hex_digit(buf[1]) >= 0)
+    return nxt_image_parse_srec(image, buf, size);
+  return NXT_INVALID_FIRMWARE;
+}
+
+static nxt_error_t
+nxt_image_parse_raw(nxt_image_t *image, const uint8_t *buf, size_t size,
+                    int page)
+{
+  // Raw binary image, starting at given flash page.
+  if (page < 0 || page >= NXT_FLASH_PAGES)
+    return NXT_INVALID_FIRMWARE;
+  if (size > NXT_FLASH_SIZE)
+    return NXT_INVALID_FIRMWARE;
+
+  // Whole pages from the start of flash are used in place, without copy.
+  if (page == 0 && size % NXT_FLASH_PAGE_SIZE == 0)
+    {
+      memset(image->populated, 0, sizeof(image->populated));
+      for (size_t i = 0; i < size / NXT_FLASH_PAGE_SIZE; i++)
+        image->populated[i] = true;
+      image->data = buf;
+      return NXT_OK;
+    }
+
+  NXT_ERR(nxt_image_clear(image));
+  return nxt_image_write(image, NXT_FLASH_ADDR + page * NXT_FLASH_PAGE_SIZE,
+                         buf, size);
+}
+
+static nxt_error_t
+nxt_image_parse(nxt_image_t *image, const uint8_t *buf, size_t size,
+                int page)
+{
+  if (size >= 4 && memcmp(buf, "\177ELF", 4) == 0)
+    {
+      NXT_ERR(nxt_image_clear(image));
+      NXT_ERR(nxt_image_parse_elf(image, buf, size));
+    }
+  else if (nxt_image_parse_text(image, buf, size) != NXT_OK)
+    NXT_ERR(nxt_image_parse_raw(image, buf, size, page));
+
+  image->pages = 0;
+  for (int i = 0; i < NXT_FLASH_PAGES; i++)
+    {
+      if (image->populated[i])
+        image->pages = i + 1;
+    }
+
+  return NXT_OK;
+}
+
+/* Read the whole input in owned memory, which is not changed if the file
+ * is rewritten while the image is used. The size is only a hint, the
+ * buffer grows as needed. */
+static nxt_error_t
+nxt_image_read_stream(nxt_image_t *image, int fd, int page, size_t hint)
+{
+  uint8_t *buf = NULL, *nbuf;
+  size_t size = 0, len = 0;
+  ssize_t ret;
+  nxt_error_t err;
+
+  do
+    {
+      if (len == size)
+        {
+          // One more byte to see the end of a file of known size.
+          if (!size)
+            size = hint ? hint + 1 : NXT_IMAGE_STREAM_CHUNK;
+          else
+            size *= 2;
+          nbuf = size <= NXT_IMAGE_STREAM_MAX ? realloc(buf, size) : NULL;
+          if (!nbuf)
+            {
+              free(buf);
+              return NXT_ERROR_NO_MEM;
+            }
+          buf = nbuf;
+        }
+      ret = read(fd, buf + len, size - len);
+      if (ret < 0)
+        {
+          free(buf);
+          return NXT_FILE_ERROR;
+        }
+      len += ret;
+    }
+  while (ret);
+
+  // Keep the buffer if the image is used in place.
+  err = nxt_image_parse(image, buf, len, page);
+  if (err == NXT_OK && image->data == buf)
+    image->buf = buf;
+  else
+    free(buf);
+
+  return err;
+}
+
+static nxt_error_t
+nxt_image_read_fd(nxt_image_t *image, int fd, int page)
+{
+  struct stat s;
+
+  if (fstat(fd, &s) < 0)
+    return NXT_FILE_ERROR;
+
+  // The size of a regular file avoids growing the buffer.
+  if (S_ISREG(s.st_mode) && (size_t)s.st_size < NXT_IMAGE_STREAM_MAX)
+    return nxt_image_read_stream(image, fd, page, s.st_size);
+  return nxt_image_read_stream(image, fd, page, 0);
+}
+
+nxt_error_t
+nxt_image_load_buffer(nxt_image_t **image, const uint8_t *buf, size_t len,
+                      int page)
+{
+  nxt_error_t err;
+  nxt_image_t *limage;
+
+  limage = calloc(1, sizeof(*limage));
+  if (!limage)
+    return NXT_ERROR_NO_MEM;
+
+  err = nxt_image_parse(limage, buf, len, page);
+  if (err != NXT_OK)
+    {
+      nxt_image_free(limage);
+      return err;
+    }
+
+  *image = limage;
+  return NXT_OK;
+}
+
+nxt_error_t
+nxt_image_load_fd(nxt_image_t **image, int fd, int page)
+{
+  nxt_error_t err;
+  nxt_image_t *limage;
+
+  limage = calloc(1, sizeof(*limage));
+  if (!limage)
+    return NXT_ERROR_NO_MEM;
+
+  err = nxt_image_read_fd(limage, fd, page);
+  if (err != NXT_OK)
+    {
+      nxt_image_free(limage);
+      return err;
+    }
+
+  *image = limage;
+  return NXT_OK;
+}
+
+nxt_error_t
+nxt_image_load_at(nxt_image_t **image, const char *path, int page)
+{
+  nxt_error_t err;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NXT_FILE_ERROR;
+
+  err = nxt_image_load_fd(image, fd, page);
+  close(fd);
+
+  return err;
+}
+
+nxt_error_t
+nxt_image_load(nxt_image_t **image, const char *path)
+{
+  nxt_error_t err;
+
+  NXT_ERR(nxt_image_load_at(image, path, 0));
+  err = nxt_image_validate(*image);
+  if (err != NXT_OK)
+    {
+      nxt_image_free(*image);
+      return err;
+    }
+
+  return NXT_OK;
+}
+
+void
+nxt_image_free(nxt_image_t *image)
+{
+  if (!image)
+    return;
+  free(image->buf);
+  free(image->storage);
+  free(image);
+}
+
+nxt_error_t
+nxt_image_validate(const nxt_image_t *image)
+{
+  const uint8_t *vectors = image->data;
+
+  if (!image->populated[0])
+    return NXT_INVALID_FIRMWARE;
+
+  // Does it looks like ARM vectors?
+  for (int i = 0; i < 6; i++)
+    {
+      uint32_t v = vectors[i * 4] | vectors[i * 4 + 1] << 8 |
+                   vectors[i * 4 + 2] << 16 | vectors[i * 4 + 3] << 24;
+      if (v != 0xe1a00000                   // nop
+          && v != 0xeafffffe                // branch here (-4)
+          && (v & 0xffff0000) != 0xea000000 // branch forward
+          && (v & 0xfffff000) != 0xe59ff000 // ldr pc, [pc, #xx]
+      )
+        return NXT_INVALID_FIRMWARE;
+    }
+
+  return NXT_OK;
+}
+
+bool
+nxt_image_page_blank(const nxt_image_t *image, int page)
+{
+  const uint8_t *p;
+
+  // Pages after the image are not available, and blank.
+  if (page >= image->pages)
+    return true;
+
+  // All bytes equal to the first one, which is the erased value.
+  p = image->data + page * NXT_FLASH_PAGE_SIZE;
+  return p[0] == 0xff && memcmp(p, p + 1, NXT_FLASH_PAGE_SIZE - 1) == 0;
+}
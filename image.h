@@ -0,0 +1,65 @@
+/**
+ * NXT bootstrap interface; NXT firmware image handling code.
+ *
+ * Copyright 2006 David Anderson <dave@natulte.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "error.h"
+
+#define NXT_FLASH_ADDR 0x00100000
+#define NXT_FLASH_PAGE_SIZE 256
+#define NXT_FLASH_PAGES 1024
+#define NXT_FLASH_SIZE (NXT_FLASH_PAGES * NXT_FLASH_PAGE_SIZE)
+
+typedef struct
+{
+  /* Image content, one byte per flash byte, 0xff where not populated. Only
+   * the image pages are available, pages after them are blank. A raw image
+   * of whole pages from the start of flash is used in place, data then
+   * points into the read buffer or the caller buffer. */
+  const uint8_t *data;
+  /* Pages containing data from the image file. */
+  bool populated[NXT_FLASH_PAGES];
+  /* Number of pages in image, up to the last populated page. */
+  int pages;
+  /* Memory owned by the image: copy of the content, or read buffer used in
+   * place. */
+  uint8_t *storage;
+  uint8_t *buf;
+} nxt_image_t;
+
+nxt_error_t nxt_image_load(nxt_image_t **image, const char *path);
+nxt_error_t nxt_image_load_at(nxt_image_t **image, const char *path,
+                              int page);
+nxt_error_t nxt_image_load_fd(nxt_image_t **image, int fd, int page);
+/* The image may use buf in place, it must be kept until the image is
+ * freed. */
+nxt_error_t nxt_image_load_buffer(nxt_image_t **image, const uint8_t *buf,
+                                  size_t len, int page);
+void nxt_image_free(nxt_image_t *image);
+nxt_error_t nxt_image_validate(const nxt_image_t *image);
+bool nxt_image_page_blank(const nxt_image_t *image, int page);
+
+#endif /* __IMAGE_H__ */
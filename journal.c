@@ -0,0 +1,156 @@
+/**
+ * NXT bootstrap interface; flashing journal.
+ *
+ * Copyright 2026 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "journal.h"
+
+#include "crc.h"
+
+#define NXT_JOURNAL_MAGIC "libnxt journal 1"
+
+uint32_t
+nxt_journal_digest(const nxt_image_t *image)
+{
+  uint32_t crc = 0;
+
+  for (int i = 0; i < NXT_FLASH_PAGES; i++)
+    {
+      if (image->populated[i])
+        {
+          uint8_t page[2] = { i & 0xff, i >> 8 };
+          crc = nxt_crc32(crc, page, sizeof(page));
+          crc = nxt_crc32(crc, image->data + i * NXT_FLASH_PAGE_SIZE,
+                          NXT_FLASH_PAGE_SIZE);
+        }
+    }
+
+  return crc;
+}
+
+static int
+hex_digit(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  else if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  else
+    return -1;
+}
+
+nxt_error_t
+nxt_journal_load(nxt_journal_t *journal, const char *path)
+{
+  FILE *f;
+  char line[NXT_FLASH_PAGES / 4 + 16];
+  unsigned long digest = 0;
+  int erased = 0, n, ok;
+
+  memset(journal, 0, sizeof(*journal));
+
+  f = fopen(path, "r");
+  if (!f)
+    return NXT_FILE_ERROR;
+
+  // Text format, one field per line, pages are a bitmap, four pages per
+  // hexadecimal digit.
+  ok = fgets(line, sizeof(line), f)
+       && strcmp(line, NXT_JOURNAL_MAGIC "\n") == 0;
+  ok = ok && fgets(line, sizeof(line), f)
+       && sscanf(line, "key %31s", journal->key) == 1;
+  ok = ok && fgets(line, sizeof(line), f)
+       && sscanf(line, "digest %lx", &digest) == 1;
+  ok = ok && fgets(line, sizeof(line), f)
+       && sscanf(line, "erased %d", &erased) == 1;
+  ok = ok && fgets(line, sizeof(line), f) && strncmp(line, "pages ", 6) == 0;
+  for (n = 0; n < NXT_FLASH_PAGES / 4 && ok; n++)
+    {
+      int v = hex_digit(line[6 + n]);
+      if (v < 0)
+        ok = 0;
+      for (int i = 0; i < 4 && ok; i++)
+        journal->done[n * 4 + i] = v & (1 << i);
+    }
+  journal->digest = digest;
+  journal->erased = erased;
+  fclose(f);
+
+  if (!ok)
+    {
+      memset(journal, 0, sizeof(*journal));
+      return NXT_FILE_ERROR;
+    }
+
+  return NXT_OK;
+}
+
+nxt_error_t
+nxt_journal_save(const nxt_journal_t *journal, const char *path)
+{
+  FILE *f;
+  char *tmp;
+  int ok;
+
+  // Write to a temporary file, then rename, so that the journal is never
+  // found half written.
+  tmp = malloc(strlen(path) + sizeof(".tmp"));
+  if (!tmp)
+    return NXT_ERROR_NO_MEM;
+  strcpy(tmp, path);
+  strcat(tmp, ".tmp");
+
+  f = fopen(tmp, "w");
+  if (!f)
+    {
+      free(tmp);
+      return NXT_FILE_ERROR;
+    }
+  fprintf(f, NXT_JOURNAL_MAGIC "\nkey %s\ndigest %08lx\nerased %d\npages ",
+          journal->key, (unsigned long)journal->digest, journal->erased);
+  for (int n = 0; n < NXT_FLASH_PAGES / 4; n++)
+    {
+      int v = 0;
+      for (int i = 0; i < 4; i++)
+        v |= journal->done[n * 4 + i] << i;
+      fputc("0123456789abcdef"[v], f);
+    }
+  fputc('\n', f);
+  ok = !ferror(f);
+  ok = fclose(f) == 0 && ok;
+  ok = ok && rename(tmp, path) == 0;
+  if (!ok)
+    remove(tmp);
+  free(tmp);
+
+  return ok ? NXT_OK : NXT_FILE_ERROR;
+}
+
+nxt_error_t
+nxt_journal_remove(const char *path)
+{
+  if (remove(path) != 0)
+    return NXT_FILE_ERROR;
+
+  return NXT_OK;
+}
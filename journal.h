@@ -0,0 +1,51 @@
+/**
+ * NXT bootstrap interface; flashing journal.
+ *
+ * Copyright 2026 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "image.h"
+#include "lowlevel.h"
+
+/* Record of pages confirmed to be programmed, used to resume an
+ * interrupted flashing. */
+typedef struct
+{
+  /* Brick identification, its USB port path. */
+  char key[NXT_PORT_PATH_SIZE];
+  /* Image digest. */
+  uint32_t digest;
+  /* Erase All done. */
+  bool erased;
+  /* Pages confirmed to be programmed. */
+  bool done[NXT_FLASH_PAGES];
+} nxt_journal_t;
+
+uint32_t nxt_journal_digest(const nxt_image_t *image);
+nxt_error_t nxt_journal_load(nxt_journal_t *journal, const char *path);
+nxt_error_t nxt_journal_save(const nxt_journal_t *journal, const char *path);
+nxt_error_t nxt_journal_remove(const char *path);
+
+#endif /* __JOURNAL_H__ */
@@ -22,9 +22,14 @@
 
 #include <assert.h>
 #include <libusb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
+#include <time.h>
 
 #include "cmd.h"
 #include "lowlevel.h"
@@ -32,6 +37,28 @@
 #define NXT_LEGO_USB_SERIAL_OUI "001653"
 #define NXT_LEGO_USB_SERIAL_LEN 12
 
+/* Number of attempts to clear a stalled endpoint during a transfer. */
+#define NXT_USB_HALT_RETRIES 3
+/* Time to wait for a device to come back, in seconds. */
+#define NXT_RECONNECT_TIMEOUT 5.0
+/* Polling period when waiting for a device, in microseconds. */
+#define NXT_WAIT_POLL_US 50000
+/* Number of devices remembered in the enumeration cache, power of two. */
+#define NXT_CACHE_SIZE 32
+/* Maximum number of bricks queried at the same time when listing. */
+#define NXT_QUERY_WORKERS 8
+/* Time to wait for stale data when reusing a connection, in milliseconds. */
+#define NXT_RESYNC_TIMEOUT_MS 20
+/* Maximum number of stale packets to drop when reusing a connection. */
+#define NXT_RESYNC_PACKETS 64
+/* Maximum number of transfers in flight for a device. */
+#define NXT_TRANSFER_POOL 8
+/* Default time limit for a transfer, in seconds. */
+#define NXT_DEFAULT_TIMEOUT 10.0
+/* Room in front of transfer buffers to remember how they were allocated,
+ * keeps buffers aligned. */
+#define NXT_BUF_HEADER 16
+
 const struct
 {
   int vendor_id;
@@ -43,53 +70,320 @@ const struct
   { 0x0694, 0xFF00, 0 }  /* NXTOS  */
 };
 
-struct nxt_t
+/* Information gathered about a device, valid as long as the device stays
+ * at the same address on the same port. */
+typedef struct
+{
+  char port_path[NXT_PORT_PATH_SIZE];
+  uint8_t address;
+  nxt_firmware firmware;
+  bool has_serial;
+  char serial[NXT_SERIAL_SIZE];
+  bool has_info;
+  nxt_device_info_t info;
+} nxt_cache_entry_t;
+
+/* Slot in the transfer pool, the libusb transfer is allocated on first use
+ * and reused. */
+typedef struct
+{
+  struct libusb_transfer *xfer;
+  /* Set once the transfer callback returned, the owner may then reuse or
+   * free the slot. Also the libusb completion flag to wait for the transfer,
+   * libusb reads it as a plain int. */
+  atomic_int idle;
+  nxt_transfer_cb_t cb;
+  void *user;
+} nxt_transfer_slot_t;
+
+/* Shared between all device handles, which may be used from several
+ * threads. */
+struct nxt_context_t
 {
   libusb_context *usb;
+  nxt_pollfd_added_cb_t pollfd_added;
+  nxt_pollfd_removed_cb_t pollfd_removed;
+  void *pollfd_user;
+  /* Protects the cache, never held during USB operations, as they may call
+   * the hotplug callback. */
+  pthread_mutex_t lock;
+  nxt_cache_entry_t cache[NXT_CACHE_SIZE];
+  bool cache_hotplug;
+  libusb_hotplug_callback_handle cache_handle;
+};
+
+struct nxt_t
+{
+  nxt_context_t *ctx;
+  bool own_ctx;
   libusb_device *dev;
   nxt_firmware firmware;
   int interface;
   libusb_device_handle *hdl;
+  /* Connection kept open by nxt_close in persistent mode. */
+  bool persistent;
+  libusb_device *kept_dev;
+  libusb_device_handle *kept_hdl;
+  int kept_interface;
+  nxt_transfer_slot_t transfers[NXT_TRANSFER_POOL];
+  /* Slots are used in turn, when the pool is full, this is the oldest
+   * transfer. */
+  int next_slot;
+  /* Time limit for each transfer, in seconds, 0 for none. */
+  double timeout;
+  /* Set by nxt_cancel, possibly from another thread. */
+  atomic_bool cancelled;
 };
 
+static void nxt_cancel_transfers(nxt_t *nxt);
+static int LIBUSB_CALL nxt_cache_hotplug_cb(libusb_context *usb,
+                                            libusb_device *dev,
+                                            libusb_hotplug_event event,
+                                            void *user);
+static void nxt_free_transfers(nxt_t *nxt);
+
 nxt_error_t
-nxt_init(nxt_t **nxt)
+nxt_context_init(nxt_context_t **ctx)
 {
   int ret;
-  nxt_t *lnxt;
+  nxt_context_t *lctx;
 
-  lnxt = calloc(1, sizeof(*lnxt));
-  if (!lnxt)
+  lctx = calloc(1, sizeof(*lctx));
+  if (!lctx)
     return NXT_ERROR_NO_MEM;
 
-  ret = libusb_init(&lnxt->usb);
+  ret = libusb_init(&lctx->usb);
   if (ret < 0)
     {
-      free(lnxt);
+      free(lctx);
       return NXT_ERROR_USB(ret);
     }
+  pthread_mutex_init(&lctx->lock, NULL);
+
+  // Forget about devices as soon as they are plugged or unplugged.
+  if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+    {
+      ret = libusb_hotplug_register_callback(
+          lctx->usb,
+          LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED
+              | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+          0, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+          LIBUSB_HOTPLUG_MATCH_ANY, nxt_cache_hotplug_cb, lctx,
+          &lctx->cache_handle);
+      lctx->cache_hotplug = ret == LIBUSB_SUCCESS;
+    }
+
+  *ctx = lctx;
+  return NXT_OK;
+}
+
+void
+nxt_context_exit(nxt_context_t *ctx)
+{
+  if (ctx->cache_hotplug)
+    libusb_hotplug_deregister_callback(ctx->usb, ctx->cache_handle);
+  libusb_exit(ctx->usb);
+  pthread_mutex_destroy(&ctx->lock);
+  free(ctx);
+}
+
+static void
+nxt_init_transfers(nxt_t *nxt)
+{
+  for (int i = 0; i < NXT_TRANSFER_POOL; i++)
+    atomic_init(&nxt->transfers[i].idle, 1);
+}
+
+nxt_error_t
+nxt_open_context(nxt_t **nxt, nxt_context_t *ctx)
+{
+  nxt_t *lnxt;
+
+  lnxt = calloc(1, sizeof(*lnxt));
+  if (!lnxt)
+    return NXT_ERROR_NO_MEM;
 
+  lnxt->ctx = ctx;
+  lnxt->timeout = NXT_DEFAULT_TIMEOUT;
+  nxt_init_transfers(lnxt);
   *nxt = lnxt;
   return NXT_OK;
 }
 
+nxt_error_t
+nxt_init(nxt_t **nxt)
+{
+  nxt_context_t *ctx;
+  nxt_error_t err;
+
+  // Private context, released with the handle.
+  NXT_ERR(nxt_context_init(&ctx));
+  err = nxt_open_context(nxt, ctx);
+  if (err != NXT_OK)
+    {
+      nxt_context_exit(ctx);
+      return err;
+    }
+  (*nxt)->own_ctx = true;
+  return NXT_OK;
+}
+
 void
 nxt_exit(nxt_t *nxt)
 {
   nxt_close(nxt);
-  libusb_exit(nxt->usb);
+  nxt_set_persistent(nxt, false);
+  nxt_free_transfers(nxt);
+  if (nxt->own_ctx)
+    nxt_context_exit(nxt->ctx);
   free(nxt);
 }
 
+nxt_context_t *
+nxt_get_context(nxt_t *nxt)
+{
+  return nxt->ctx;
+}
+
+void
+nxt_set_timeout(nxt_t *nxt, double timeout)
+{
+  nxt->timeout = timeout;
+}
+
+static void
+nxt_get_port_path_dev(libusb_device *dev, char *path, size_t path_size)
+{
+  uint8_t ports[7];
+  int n, ret, len;
+
+  len = snprintf(path, path_size, "%d", libusb_get_bus_number(dev));
+  n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+  for (int i = 0; i < n; i++)
+    {
+      ret = snprintf(path + len, path_size - len, "%c%d", i ? '.' : '-',
+                     ports[i]);
+      len += ret;
+    }
+  assert(len < (int)path_size);
+}
+
 static void
 nxt_get_connection(libusb_device *dev, char *connection, size_t connection_size)
 {
+  char path[NXT_PORT_PATH_SIZE];
   int ret;
-  ret = snprintf(connection, connection_size, "usb.%d.%d",
-                 libusb_get_bus_number(dev), libusb_get_device_address(dev));
+
+  // Port path is stable, the device address changes on each reset.
+  nxt_get_port_path_dev(dev, path, sizeof(path));
+  ret = snprintf(connection, connection_size, "usb.%s", path);
   assert(ret < (int)connection_size);
 }
 
+/* Cache functions are called with the context lock held. */
+static nxt_cache_entry_t *
+nxt_cache_lookup(nxt_context_t *ctx, const char *port_path, bool create)
+{
+  uint32_t hash = 2166136261u;
+  unsigned int i;
+
+  // FNV-1a hash of the port path, with linear probing.
+  for (const char *p = port_path; *p; p++)
+    hash = (hash ^ (uint8_t)*p) * 16777619u;
+  for (i = 0; i < NXT_CACHE_SIZE; i++)
+    {
+      nxt_cache_entry_t *entry
+          = &ctx->cache[(hash + i) & (NXT_CACHE_SIZE - 1)];
+      if (strcmp(entry->port_path, port_path) == 0)
+        return entry;
+      if (!entry->port_path[0])
+        {
+          if (!create)
+            return NULL;
+          strcpy(entry->port_path, port_path);
+          return entry;
+        }
+    }
+  return NULL;
+}
+
+static nxt_cache_entry_t *
+nxt_cache_get(nxt_context_t *ctx, libusb_device *dev, nxt_firmware fw)
+{
+  char path[NXT_PORT_PATH_SIZE];
+  nxt_cache_entry_t *entry;
+  uint8_t address = libusb_get_device_address(dev);
+
+  nxt_get_port_path_dev(dev, path, sizeof(path));
+  entry = nxt_cache_lookup(ctx, path, true);
+  if (!entry)
+    return NULL;
+
+  // A new address means the device was reset or replaced.
+  if (entry->address != address || entry->firmware != fw)
+    {
+      entry->address = address;
+      entry->firmware = fw;
+      entry->has_serial = false;
+      entry->has_info = false;
+    }
+  return entry;
+}
+
+static void
+nxt_cache_invalidate(nxt_cache_entry_t *entry)
+{
+  entry->address = 0;
+  entry->has_serial = false;
+  entry->has_info = false;
+}
+
+static int LIBUSB_CALL
+nxt_cache_hotplug_cb(libusb_context *usb, libusb_device *dev,
+                     libusb_hotplug_event event, void *user)
+{
+  nxt_context_t *ctx = user;
+  char path[NXT_PORT_PATH_SIZE];
+  nxt_cache_entry_t *entry;
+
+  (void)usb;
+  (void)event;
+
+  nxt_get_port_path_dev(dev, path, sizeof(path));
+  pthread_mutex_lock(&ctx->lock);
+  entry = nxt_cache_lookup(ctx, path, false);
+  if (entry)
+    nxt_cache_invalidate(entry);
+  pthread_mutex_unlock(&ctx->lock);
+  return 0;
+}
+
+static void
+nxt_cache_update(nxt_context_t *ctx)
+{
+  // Dispatch pending hotplug events, without waiting.
+  if (ctx->cache_hotplug)
+    nxt_handle_events_nowait(ctx);
+}
+
+void
+nxt_refresh(nxt_context_t *ctx)
+{
+  pthread_mutex_lock(&ctx->lock);
+  for (int i = 0; i < NXT_CACHE_SIZE; i++)
+    nxt_cache_invalidate(&ctx->cache[i]);
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+static double
+nxt_wait_time(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 static nxt_firmware
 nxt_get_firmware(const struct libusb_device_descriptor *desc)
 {
@@ -125,6 +419,37 @@ serial_to_mac(char *serial)
   serial[2] = ':';
 }
 
+static int
+nxt_get_serial_sysfs(libusb_device *dev, char *serial, size_t serial_size)
+{
+#ifdef __linux__
+  char path[NXT_PORT_PATH_SIZE];
+  char file[sizeof("/sys/bus/usb/devices//serial") + NXT_PORT_PATH_SIZE];
+  FILE *f;
+  size_t len;
+
+  // Linux names USB devices after their port path.
+  nxt_get_port_path_dev(dev, path, sizeof(path));
+  snprintf(file, sizeof(file), "/sys/bus/usb/devices/%s/serial", path);
+  f = fopen(file, "r");
+  if (!f)
+    return -1;
+  if (!fgets(serial, serial_size, f))
+    serial[0] = '\0';
+  fclose(f);
+
+  len = strlen(serial);
+  if (len && serial[len - 1] == '\n')
+    serial[--len] = '\0';
+  return len ? (int)len : -1;
+#else
+  (void)dev;
+  (void)serial;
+  (void)serial_size;
+  return -1;
+#endif
+}
+
 static nxt_error_t
 nxt_get_serial(libusb_device *dev, const struct libusb_device_descriptor *desc,
                char *serial, size_t serial_size)
@@ -132,6 +457,18 @@ nxt_get_serial(libusb_device *dev, const struct libusb_device_descriptor *desc,
   int ret;
   libusb_device_handle *hdl;
 
+  // Try without opening the device first.
+  ret = nxt_get_serial_sysfs(dev, serial, serial_size);
+  if (ret > 0)
+    {
+      if (ret == NXT_LEGO_USB_SERIAL_LEN &&
+          memcmp(serial, NXT_LEGO_USB_SERIAL_OUI,
+                 strlen(NXT_LEGO_USB_SERIAL_OUI)) == 0 &&
+          serial_size >= NXT_SERIAL_SIZE)
+        serial_to_mac(serial);
+      return NXT_OK;
+    }
+
   ret = libusb_open(dev, &hdl);
   if (ret != 0)
     {
@@ -157,13 +494,11 @@ nxt_get_serial(libusb_device *dev, const struct libusb_device_descriptor *desc,
 }
 
 static nxt_error_t
-nxt_get_name(nxt_t *nxt, libusb_device *dev, char *name, size_t name_size)
+nxt_get_device_info(nxt_t *nxt, libusb_device *dev,
+                    nxt_device_info_t *device_info)
 {
-  nxt_device_info_t device_info;
   nxt_error_t ret;
 
-  assert(name_size >= sizeof(device_info.name));
-
   libusb_ref_device(dev);
   nxt->dev = dev;
   nxt->firmware = LEGO;
@@ -176,24 +511,194 @@ nxt_get_name(nxt_t *nxt, libusb_device *dev, char *name, size_t name_size)
       nxt->dev = NULL;
       return ret;
     }
-  ret = nxt_cmd_get_device_info(nxt, &device_info);
+  ret = nxt_cmd_get_device_info(nxt, device_info);
   nxt_close(nxt);
-  if (ret == NXT_OK)
-    memcpy(name, device_info.name, sizeof(device_info.name));
 
   return ret;
 }
 
+static nxt_error_t
+nxt_get_serial_cached(nxt_t *nxt, libusb_device *dev,
+                      const struct libusb_device_descriptor *desc,
+                      char *serial, size_t serial_size)
+{
+  nxt_context_t *ctx = nxt->ctx;
+  nxt_cache_entry_t *entry;
+  bool found = false;
+
+  assert(serial_size >= NXT_SERIAL_SIZE);
+
+  pthread_mutex_lock(&ctx->lock);
+  entry = nxt_cache_get(ctx, dev, LEGO);
+  if (entry && entry->has_serial)
+    {
+      strcpy(serial, entry->serial);
+      found = true;
+    }
+  pthread_mutex_unlock(&ctx->lock);
+  if (found)
+    return NXT_OK;
+
+  NXT_ERR(nxt_get_serial(dev, desc, serial, serial_size));
+
+  pthread_mutex_lock(&ctx->lock);
+  entry = nxt_cache_get(ctx, dev, LEGO);
+  if (entry)
+    {
+      snprintf(entry->serial, sizeof(entry->serial), "%s", serial);
+      entry->has_serial = true;
+    }
+  pthread_mutex_unlock(&ctx->lock);
+  return NXT_OK;
+}
+
+static nxt_error_t
+nxt_get_name_cached(nxt_t *nxt, libusb_device *dev, char *name,
+                    size_t name_size)
+{
+  nxt_context_t *ctx = nxt->ctx;
+  nxt_cache_entry_t *entry;
+  nxt_device_info_t device_info;
+  bool found = false;
+
+  assert(name_size >= sizeof(device_info.name));
+
+  pthread_mutex_lock(&ctx->lock);
+  entry = nxt_cache_get(ctx, dev, LEGO);
+  if (entry && entry->has_info)
+    {
+      device_info = entry->info;
+      found = true;
+    }
+  pthread_mutex_unlock(&ctx->lock);
+
+  if (!found)
+    {
+      NXT_ERR(nxt_get_device_info(nxt, dev, &device_info));
+      // Device may have been reset, remember its current address.
+      pthread_mutex_lock(&ctx->lock);
+      entry = nxt_cache_get(ctx, dev, LEGO);
+      if (entry)
+        {
+          entry->info = device_info;
+          entry->has_info = true;
+        }
+      pthread_mutex_unlock(&ctx->lock);
+    }
+
+  memcpy(name, device_info.name, sizeof(device_info.name));
+  return NXT_OK;
+}
+
+typedef struct
+{
+  nxt_t *nxt;
+  libusb_device **devs;
+  nxt_device_info_t *infos;
+  nxt_error_t *errs;
+  int count;
+  /* Next device to query, protected by lock. */
+  int next;
+  pthread_mutex_t lock;
+} nxt_query_t;
+
+static void *
+nxt_query_worker(void *arg)
+{
+  nxt_query_t *query = arg;
+  nxt_t worker = { .ctx = query->nxt->ctx, .timeout = query->nxt->timeout };
+  int i;
+
+  nxt_init_transfers(&worker);
+  // Each worker uses its own handle on the shared context.
+  for (;;)
+    {
+      pthread_mutex_lock(&query->lock);
+      i = query->next++;
+      pthread_mutex_unlock(&query->lock);
+      if (i >= query->count)
+        break;
+      query->errs[i]
+          = nxt_get_device_info(&worker, query->devs[i], &query->infos[i]);
+    }
+  nxt_free_transfers(&worker);
+  return NULL;
+}
+
+static void
+nxt_query_names(nxt_t *nxt, libusb_device **list, ssize_t cnt)
+{
+  libusb_device *devs[NXT_CACHE_SIZE];
+  nxt_device_info_t infos[NXT_CACHE_SIZE];
+  nxt_error_t errs[NXT_CACHE_SIZE];
+  nxt_query_t query = { .nxt = nxt, .devs = devs, .infos = infos,
+                        .errs = errs };
+  pthread_t threads[NXT_QUERY_WORKERS];
+  int started = 0;
+  nxt_context_t *ctx = nxt->ctx;
+
+  // Collect bricks which name is not known yet.
+  pthread_mutex_lock(&ctx->lock);
+  for (ssize_t i = 0; i < cnt && query.count < NXT_CACHE_SIZE; i++)
+    {
+      struct libusb_device_descriptor desc;
+      nxt_cache_entry_t *entry;
+      if (libusb_get_device_descriptor(list[i], &desc) != 0
+          || nxt_get_firmware(&desc) != LEGO)
+        continue;
+      entry = nxt_cache_get(ctx, list[i], LEGO);
+      if (entry && !entry->has_info)
+        devs[query.count++] = list[i];
+    }
+  pthread_mutex_unlock(&ctx->lock);
+  if (query.count < 2)
+    return;
+
+  // Each query is an open, a reset and a round trip, do them in parallel.
+  pthread_mutex_init(&query.lock, NULL);
+  while (started < NXT_QUERY_WORKERS && started < query.count
+         && pthread_create(&threads[started], NULL, nxt_query_worker, &query)
+                == 0)
+    started++;
+  if (!started)
+    nxt_query_worker(&query);
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  pthread_mutex_destroy(&query.lock);
+
+  pthread_mutex_lock(&ctx->lock);
+  for (int i = 0; i < query.count; i++)
+    {
+      nxt_cache_entry_t *entry = nxt_cache_get(ctx, devs[i], LEGO);
+      if (errs[i] == NXT_OK && entry)
+        {
+          entry->info = infos[i];
+          entry->has_info = true;
+        }
+    }
+  pthread_mutex_unlock(&ctx->lock);
+}
+
 nxt_error_t
 nxt_list(nxt_t *nxt, nxt_list_cb_t cb, void *user)
+{
+  return nxt_list_devices(nxt, true, cb, user);
+}
+
+nxt_error_t
+nxt_list_devices(nxt_t *nxt, bool names, nxt_list_cb_t cb, void *user)
 {
   libusb_device **list;
 
   assert(!nxt->dev);
+  nxt_cache_update(nxt->ctx);
 
-  ssize_t cnt = libusb_get_device_list(nxt->usb, &list);
+  ssize_t cnt = libusb_get_device_list(nxt->ctx->usb, &list);
   if (cnt < 0)
     return NXT_ERROR_USB(cnt);
+  // Fill the cache first, callbacks are still called in enumeration order.
+  if (names)
+    nxt_query_names(nxt, list, cnt);
   for (ssize_t i = 0; i < cnt; i++)
     {
       libusb_device *dev = list[i];
@@ -213,13 +718,16 @@ nxt_list(nxt_t *nxt, nxt_list_cb_t cb, void *user)
               nxt_get_connection(dev, connection, sizeof(connection));
               if (fw == LEGO)
                 {
-                  nxt_error_t nret = nxt_get_serial(dev, &desc, serial_tab,
-                                                    sizeof(serial_tab));
+                  nxt_error_t nret = nxt_get_serial_cached(
+                      nxt, dev, &desc, serial_tab, sizeof(serial_tab));
                   if (nret == NXT_OK)
                     serial = serial_tab;
 
-                  nret = nxt_get_name(nxt, dev, name_tab, sizeof(name_tab));
-                  if (nret == NXT_OK)
+                  // Getting the name needs to open and reset the brick.
+                  if (names)
+                    nret = nxt_get_name_cached(nxt, dev, name_tab,
+                                               sizeof(name_tab));
+                  if (names && nret == NXT_OK)
                     name = name_tab;
                 }
               cb(user, connection, fw, serial, name);
@@ -238,8 +746,9 @@ nxt_find(nxt_t *nxt, nxt_firmware match_fw, const char *match_serial,
   libusb_device **list;
 
   assert(!nxt->dev);
+  nxt_cache_update(nxt->ctx);
 
-  ssize_t cnt = libusb_get_device_list(nxt->usb, &list);
+  ssize_t cnt = libusb_get_device_list(nxt->ctx->usb, &list);
   if (cnt < 0)
     {
       return NXT_ERROR_USB(cnt);
@@ -260,7 +769,8 @@ nxt_find(nxt_t *nxt, nxt_firmware match_fw, const char *match_serial,
               if (fw == LEGO && match_serial)
                 {
                   char serial[NXT_SERIAL_SIZE];
-                  nret = nxt_get_serial(dev, &desc, serial, sizeof(serial));
+                  nret = nxt_get_serial_cached(nxt, dev, &desc, serial,
+                                               sizeof(serial));
                   if (nret != NXT_OK)
                     continue;
                   if (strcmp(match_serial, serial) != 0)
@@ -269,7 +779,7 @@ nxt_find(nxt_t *nxt, nxt_firmware match_fw, const char *match_serial,
               if (fw == LEGO && match_name)
                 {
                   char name[NXT_NAME_SIZE];
-                  nret = nxt_get_name(nxt, dev, name, sizeof(name));
+                  nret = nxt_get_name_cached(nxt, dev, name, sizeof(name));
                   if (nret != NXT_OK)
                     continue;
                   if (strcmp(match_name, name) != 0)
@@ -289,6 +799,403 @@ nxt_find(nxt_t *nxt, nxt_firmware match_fw, const char *match_serial,
   return NXT_NOT_PRESENT;
 }
 
+static nxt_error_t
+nxt_transfer_status_error(enum libusb_transfer_status status)
+{
+  switch (status)
+    {
+    case LIBUSB_TRANSFER_COMPLETED:
+      return NXT_OK;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+      return NXT_TIMEOUT;
+    case LIBUSB_TRANSFER_STALL:
+      return NXT_ERROR_USB(LIBUSB_ERROR_PIPE);
+    case LIBUSB_TRANSFER_NO_DEVICE:
+      return NXT_ERROR_USB(LIBUSB_ERROR_NO_DEVICE);
+    case LIBUSB_TRANSFER_OVERFLOW:
+      return NXT_ERROR_USB(LIBUSB_ERROR_OVERFLOW);
+    case LIBUSB_TRANSFER_CANCELLED:
+      return NXT_CANCELLED;
+    default:
+      return NXT_ERROR_USB(LIBUSB_ERROR_IO);
+    }
+}
+
+static void LIBUSB_CALL
+nxt_transfer_done(struct libusb_transfer *xfer)
+{
+  nxt_transfer_slot_t *slot = xfer->user_data;
+
+  slot->cb(slot->user, nxt_transfer_status_error(xfer->status),
+           xfer->actual_length);
+  // Release the slot last, a waiting thread may free it as soon as it sees
+  // it idle, a callback submitting again uses another slot. Set from the
+  // event handling thread, so that libusb wakes up a thread waiting for it.
+  atomic_store_explicit(&slot->idle, 1, memory_order_release);
+}
+
+/* Handle events until completed is set, or until deadline, 0 for none.
+ * Events may be handled by another thread, the flag must be set by a
+ * transfer callback for libusb to wake up this one. */
+static nxt_error_t
+nxt_handle_events_completed(nxt_t *nxt, int *completed, double deadline)
+{
+  int ret;
+
+  while (!*completed)
+    {
+      if (deadline > 0.0)
+        {
+          double left = deadline - nxt_wait_time();
+          struct timeval tv;
+
+          if (left <= 0.0)
+            return NXT_TIMEOUT;
+          tv.tv_sec = (time_t)left;
+          tv.tv_usec = (suseconds_t)((left - tv.tv_sec) * 1e6);
+          ret = libusb_handle_events_timeout_completed(nxt->ctx->usb, &tv,
+                                                       completed);
+        }
+      else
+        ret = libusb_handle_events_completed(nxt->ctx->usb, completed);
+      if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+        return NXT_ERROR_USB(ret);
+    }
+  return NXT_OK;
+}
+
+static bool
+nxt_slot_idle(nxt_transfer_slot_t *slot)
+{
+  return atomic_load_explicit(&slot->idle, memory_order_acquire);
+}
+
+/* Wait until the callback of the slot transfer returned. */
+static nxt_error_t
+nxt_slot_wait(nxt_t *nxt, nxt_transfer_slot_t *slot, double deadline)
+{
+  static_assert(sizeof(atomic_int) == sizeof(int),
+                "atomic_int can not be used as a libusb flag");
+  NXT_ERR(nxt_handle_events_completed(nxt, (int *)&slot->idle, deadline));
+  // Pairs with the release in nxt_transfer_done.
+  atomic_thread_fence(memory_order_acquire);
+  return NXT_OK;
+}
+
+static double
+nxt_deadline(double timeout)
+{
+  return timeout > 0.0 ? nxt_wait_time() + timeout : 0.0;
+}
+
+/* Wait for all transfers of the handle, one slot after the other. */
+static nxt_error_t
+nxt_transfers_wait(nxt_t *nxt, double deadline)
+{
+  for (int i = 0; i < NXT_TRANSFER_POOL; i++)
+    NXT_ERR(nxt_slot_wait(nxt, &nxt->transfers[i], deadline));
+  return NXT_OK;
+}
+
+static unsigned int
+nxt_timeout_ms(double timeout)
+{
+  // Zero means no limit for libusb, keep at least one millisecond.
+  if (timeout <= 0.0)
+    return 0;
+  return timeout < 0.001 ? 1 : (unsigned int)(timeout * 1000);
+}
+
+static nxt_error_t
+nxt_submit(nxt_t *nxt, uint8_t endpoint, uint8_t *buf, int len,
+           double timeout, nxt_transfer_cb_t cb, void *user,
+           nxt_transfer_slot_t **slotp)
+{
+  nxt_transfer_slot_t *slot = NULL;
+  double deadline = nxt_deadline(timeout);
+  int ret;
+
+  assert(nxt->hdl);
+
+  if (atomic_load(&nxt->cancelled))
+    return NXT_CANCELLED;
+
+  for (int i = 0; !slot && i < NXT_TRANSFER_POOL; i++)
+    {
+      int n = (nxt->next_slot + i) % NXT_TRANSFER_POOL;
+
+      if (nxt_slot_idle(&nxt->transfers[n]))
+        slot = &nxt->transfers[n];
+    }
+  // When the pool is exhausted, wait for the oldest transfer.
+  if (!slot)
+    {
+      slot = &nxt->transfers[nxt->next_slot];
+      NXT_ERR(nxt_slot_wait(nxt, slot, deadline));
+    }
+  nxt->next_slot = (slot - nxt->transfers + 1) % NXT_TRANSFER_POOL;
+
+  if (!slot->xfer)
+    {
+      slot->xfer = libusb_alloc_transfer(0);
+      if (!slot->xfer)
+        return NXT_ERROR_NO_MEM;
+    }
+  libusb_fill_bulk_transfer(slot->xfer, nxt->hdl, endpoint, buf, len,
+                            nxt_transfer_done, slot, nxt_timeout_ms(timeout));
+  slot->cb = cb;
+  slot->user = user;
+  atomic_store(&slot->idle, 0);
+  ret = libusb_submit_transfer(slot->xfer);
+  if (ret < 0)
+    {
+      atomic_store(&slot->idle, 1);
+      return NXT_ERROR_USB(ret);
+    }
+  // Cancellation may have missed this transfer.
+  if (atomic_load(&nxt->cancelled))
+    libusb_cancel_transfer(slot->xfer);
+  if (slotp)
+    *slotp = slot;
+  return NXT_OK;
+}
+
+nxt_error_t
+nxt_submit_send(nxt_t *nxt, const uint8_t *buf, int len, nxt_transfer_cb_t cb,
+                void *user)
+{
+  return nxt_submit(nxt, 0x01, (uint8_t *)buf, len, nxt->timeout, cb, user,
+                    NULL);
+}
+
+nxt_error_t
+nxt_submit_recv(nxt_t *nxt, uint8_t *buf, int len, nxt_transfer_cb_t cb,
+                void *user)
+{
+  return nxt_submit(nxt, 0x82, buf, len, nxt->timeout, cb, user, NULL);
+}
+
+nxt_error_t
+nxt_handle_events(nxt_context_t *ctx)
+{
+  int ret = libusb_handle_events_completed(ctx->usb, NULL);
+  if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+    return NXT_ERROR_USB(ret);
+  return NXT_OK;
+}
+
+nxt_error_t
+nxt_handle_events_nowait(nxt_context_t *ctx)
+{
+  struct timeval zero = { 0, 0 };
+  int ret;
+
+  ret = libusb_handle_events_timeout_completed(ctx->usb, &zero, NULL);
+  if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+    return NXT_ERROR_USB(ret);
+  return NXT_OK;
+}
+
+nxt_error_t
+nxt_get_pollfds(nxt_context_t *ctx, nxt_pollfd_added_cb_t cb, void *user)
+{
+  const struct libusb_pollfd **pollfds;
+
+  pollfds = libusb_get_pollfds(ctx->usb);
+  if (!pollfds)
+    return NXT_ERROR_USB(LIBUSB_ERROR_NOT_SUPPORTED);
+  for (int i = 0; pollfds[i]; i++)
+    cb(user, pollfds[i]->fd, pollfds[i]->events);
+  libusb_free_pollfds(pollfds);
+  return NXT_OK;
+}
+
+static void LIBUSB_CALL
+nxt_pollfd_added(int fd, short events, void *user)
+{
+  nxt_context_t *ctx = user;
+
+  ctx->pollfd_added(ctx->pollfd_user, fd, events);
+}
+
+static void LIBUSB_CALL
+nxt_pollfd_removed(int fd, void *user)
+{
+  nxt_context_t *ctx = user;
+
+  ctx->pollfd_removed(ctx->pollfd_user, fd);
+}
+
+void
+nxt_set_pollfd_notifiers(nxt_context_t *ctx, nxt_pollfd_added_cb_t added,
+                         nxt_pollfd_removed_cb_t removed, void *user)
+{
+  ctx->pollfd_added = added;
+  ctx->pollfd_removed = removed;
+  ctx->pollfd_user = user;
+  libusb_set_pollfd_notifiers(ctx->usb, added ? nxt_pollfd_added : NULL,
+                              removed ? nxt_pollfd_removed : NULL, ctx);
+}
+
+nxt_error_t
+nxt_get_next_timeout(nxt_context_t *ctx, double *timeout)
+{
+  struct timeval tv;
+  int ret;
+
+  // Nothing to do when timeouts are signaled through the file descriptors.
+  *timeout = -1.0;
+  if (libusb_pollfds_handle_timeouts(ctx->usb))
+    return NXT_OK;
+
+  ret = libusb_get_next_timeout(ctx->usb, &tv);
+  if (ret < 0)
+    return NXT_ERROR_USB(ret);
+  if (ret)
+    *timeout = tv.tv_sec + tv.tv_usec / 1e6;
+  return NXT_OK;
+}
+
+nxt_error_t
+nxt_flush(nxt_t *nxt)
+{
+  nxt_error_t err;
+
+  err = nxt_transfers_wait(nxt, nxt_deadline(nxt->timeout));
+  if (err != NXT_OK)
+    nxt_cancel_transfers(nxt);
+  return err;
+}
+
+void
+nxt_cancel(nxt_t *nxt)
+{
+  atomic_store(&nxt->cancelled, true);
+  // Completion callbacks run in the thread handling events.
+  for (int i = 0; i < NXT_TRANSFER_POOL; i++)
+    if (!nxt_slot_idle(&nxt->transfers[i]) && nxt->transfers[i].xfer)
+      libusb_cancel_transfer(nxt->transfers[i].xfer);
+}
+
+typedef struct
+{
+  size_t size;
+  bool dev_mem;
+} nxt_buf_header_t;
+
+uint8_t *
+nxt_buf_alloc(nxt_t *nxt, size_t size)
+{
+  nxt_buf_header_t header = { size + NXT_BUF_HEADER, false };
+  uint8_t *mem = NULL;
+
+  assert(sizeof(header) <= NXT_BUF_HEADER);
+
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+  // Memory mapped from the kernel avoids a copy for each transfer.
+  if (nxt->hdl)
+    {
+      mem = libusb_dev_mem_alloc(nxt->hdl, header.size);
+      header.dev_mem = mem != NULL;
+    }
+#endif
+  if (!mem)
+    mem = malloc(header.size);
+  if (!mem)
+    return NULL;
+
+  memcpy(mem, &header, sizeof(header));
+  return mem + NXT_BUF_HEADER;
+}
+
+void
+nxt_buf_free(nxt_t *nxt, uint8_t *buf)
+{
+  nxt_buf_header_t header;
+  uint8_t *mem;
+
+  if (!buf)
+    return;
+  mem = buf - NXT_BUF_HEADER;
+  memcpy(&header, mem, sizeof(header));
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+  if (header.dev_mem)
+    {
+      libusb_dev_mem_free(nxt->hdl, mem, header.size);
+      return;
+    }
+#else
+  (void)nxt;
+#endif
+  free(mem);
+}
+
+static void
+nxt_cancel_transfers(nxt_t *nxt)
+{
+  for (int i = 0; i < NXT_TRANSFER_POOL; i++)
+    if (!nxt_slot_idle(&nxt->transfers[i]))
+      libusb_cancel_transfer(nxt->transfers[i].xfer);
+  // Callbacks are still called, with a cancelled status.
+  nxt_transfers_wait(nxt, nxt_deadline(NXT_DEFAULT_TIMEOUT));
+}
+
+static void
+nxt_free_transfers(nxt_t *nxt)
+{
+  for (int i = 0; i < NXT_TRANSFER_POOL; i++)
+    {
+      assert(nxt_slot_idle(&nxt->transfers[i]));
+      libusb_free_transfer(nxt->transfers[i].xfer);
+      nxt->transfers[i].xfer = NULL;
+    }
+}
+
+static void
+nxt_release_kept(nxt_t *nxt)
+{
+  if (nxt->kept_hdl)
+    {
+      libusb_release_interface(nxt->kept_hdl, nxt->kept_interface);
+      libusb_close(nxt->kept_hdl);
+      nxt->kept_hdl = NULL;
+    }
+  if (nxt->kept_dev)
+    {
+      libusb_unref_device(nxt->kept_dev);
+      nxt->kept_dev = NULL;
+    }
+}
+
+void
+nxt_set_persistent(nxt_t *nxt, bool persistent)
+{
+  nxt->persistent = persistent;
+  if (!persistent)
+    nxt_release_kept(nxt);
+}
+
+static nxt_error_t
+nxt_resync(libusb_device_handle *hdl)
+{
+  uint8_t buf[64];
+  int ret, transfered;
+
+  // Drop replies left by a previous session, until the device is quiet.
+  for (int i = 0; i < NXT_RESYNC_PACKETS; i++)
+    {
+      ret = libusb_bulk_transfer(hdl, 0x82, buf, sizeof(buf), &transfered,
+                                 NXT_RESYNC_TIMEOUT_MS);
+      if (ret == LIBUSB_ERROR_TIMEOUT)
+        return NXT_OK;
+      if (ret == LIBUSB_ERROR_PIPE)
+        ret = libusb_clear_halt(hdl, 0x82);
+      if (ret < 0)
+        return NXT_ERROR_USB(ret);
+    }
+  return NXT_ERROR_USB(LIBUSB_ERROR_OVERFLOW);
+}
+
 nxt_error_t
 nxt_open(nxt_t *nxt)
 {
@@ -298,6 +1205,21 @@ nxt_open(nxt_t *nxt)
   assert(nxt->dev);
   assert(!nxt->hdl);
 
+  atomic_store(&nxt->cancelled, false);
+
+  // Reuse the kept connection, no need to reset the device.
+  if (nxt->kept_hdl && nxt->kept_dev == nxt->dev)
+    {
+      if (nxt_resync(nxt->kept_hdl) == NXT_OK)
+        {
+          nxt->hdl = nxt->kept_hdl;
+          nxt->kept_hdl = NULL;
+          nxt_release_kept(nxt);
+          return NXT_OK;
+        }
+    }
+  nxt_release_kept(nxt);
+
   ret = libusb_open(nxt->dev, &hdl);
   if (ret < 0)
     return NXT_ERROR_USB(ret);
@@ -344,6 +1266,18 @@ nxt_open(nxt_t *nxt)
 void
 nxt_close(nxt_t *nxt)
 {
+  nxt_cancel_transfers(nxt);
+
+  // Keep the connection for the next nxt_open on the same device.
+  if (nxt->persistent && nxt->hdl)
+    {
+      nxt_release_kept(nxt);
+      nxt->kept_dev = nxt->dev;
+      nxt->kept_hdl = nxt->hdl;
+      nxt->kept_interface = nxt->interface;
+      nxt->dev = NULL;
+      nxt->hdl = NULL;
+    }
   if (nxt->hdl)
     {
       libusb_release_interface(nxt->hdl, nxt->interface);
@@ -357,25 +1291,324 @@ nxt_close(nxt_t *nxt)
     }
 }
 
+nxt_error_t
+nxt_get_port_path(nxt_t *nxt, char *path, size_t path_size)
+{
+  if (!nxt->dev)
+    return NXT_NOT_PRESENT;
+
+  nxt_get_port_path_dev(nxt->dev, path, path_size);
+  return NXT_OK;
+}
+
+static bool
+nxt_match_port_dev(libusb_device *dev, nxt_firmware *match_fw,
+                   const char *match_path)
+{
+  struct libusb_device_descriptor desc;
+  char path[NXT_PORT_PATH_SIZE];
+  nxt_firmware fw;
+
+  if (libusb_get_device_descriptor(dev, &desc) != 0)
+    return false;
+  fw = nxt_get_firmware(&desc);
+  if (fw == N_FIRMWARES || (*match_fw != N_FIRMWARES && *match_fw != fw))
+    return false;
+  if (match_path)
+    {
+      nxt_get_port_path_dev(dev, path, sizeof(path));
+      if (strcmp(path, match_path) != 0)
+        return false;
+    }
+
+  *match_fw = fw;
+  return true;
+}
+
+static libusb_device *
+nxt_find_port_dev(nxt_t *nxt, nxt_firmware *match_fw, const char *match_path)
+{
+  libusb_device **list;
+  libusb_device *found = NULL;
+
+  ssize_t cnt = libusb_get_device_list(nxt->ctx->usb, &list);
+  if (cnt < 0)
+    return NULL;
+  for (ssize_t i = 0; i < cnt && !found; i++)
+    {
+      if (nxt_match_port_dev(list[i], match_fw, match_path))
+        found = libusb_ref_device(list[i]);
+    }
+
+  libusb_free_device_list(list, 1);
+  return found;
+}
+
+typedef struct
+{
+  nxt_firmware fw;
+  const char *path;
+  /* Wait for the device to leave, instead of waiting for it to arrive. */
+  bool gone;
+  bool done;
+  libusb_device *found;
+} nxt_wait_t;
+
+static int LIBUSB_CALL
+nxt_wait_hotplug_cb(libusb_context *ctx, libusb_device *dev,
+                    libusb_hotplug_event event, void *user)
+{
+  nxt_wait_t *wait = user;
+  nxt_firmware fw = wait->fw;
+
+  (void)ctx;
+  (void)event;
+
+  if (wait->done || !nxt_match_port_dev(dev, &fw, wait->path))
+    return 0;
+  if (!wait->gone)
+    {
+      wait->fw = fw;
+      wait->found = libusb_ref_device(dev);
+    }
+  wait->done = true;
+
+  return 0;
+}
+
+/* Check the device list, when hotplug events can not be used, or for a
+ * device which left before the callback was registered. */
+static void
+nxt_wait_poll(nxt_t *nxt, nxt_wait_t *wait)
+{
+  nxt_firmware fw = wait->fw;
+  libusb_device *dev = nxt_find_port_dev(nxt, &fw, wait->path);
+
+  if (wait->gone)
+    {
+      if (dev)
+        libusb_unref_device(dev);
+      else
+        wait->done = true;
+    }
+  else if (dev)
+    {
+      wait->fw = fw;
+      wait->found = dev;
+      wait->done = true;
+    }
+}
+
+/* Wait using hotplug events, return false if they can not be used. */
+static bool
+nxt_wait_hotplug(nxt_t *nxt, nxt_wait_t *wait, double deadline)
+{
+  libusb_hotplug_callback_handle handle;
+  int ret;
+
+  if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+    return false;
+
+  // Devices already there are reported during registration.
+  ret = libusb_hotplug_register_callback(
+      nxt->ctx->usb,
+      wait->gone ? LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT
+                 : LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+      wait->gone ? 0 : LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY,
+      LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, nxt_wait_hotplug_cb,
+      wait, &handle);
+  if (ret < 0)
+    return false;
+  if (wait->gone)
+    nxt_wait_poll(nxt, wait);
+
+  while (!wait->done)
+    {
+      double left = deadline - nxt_wait_time();
+      struct timeval tv = { 0, NXT_WAIT_POLL_US };
+      if (left <= 0)
+        break;
+      if (left * 1000000 < NXT_WAIT_POLL_US)
+        tv.tv_usec = left * 1000000;
+      libusb_handle_events_timeout_completed(nxt->ctx->usb, &tv, NULL);
+    }
+
+  libusb_hotplug_deregister_callback(nxt->ctx->usb, handle);
+  return true;
+}
+
+static void
+nxt_wait_event(nxt_t *nxt, nxt_wait_t *wait, double timeout)
+{
+  const struct timespec poll = { 0, NXT_WAIT_POLL_US * 1000 };
+  double deadline = nxt_wait_time() + timeout;
+
+  // Use hotplug events if possible, else poll often.
+  if (nxt_wait_hotplug(nxt, wait, deadline))
+    return;
+  for (;;)
+    {
+      nxt_wait_poll(nxt, wait);
+      if (wait->done || nxt_wait_time() >= deadline)
+        break;
+      nanosleep(&poll, NULL);
+    }
+}
+
+nxt_error_t
+nxt_wait(nxt_t *nxt, nxt_firmware match_fw, const char *port_path,
+         double timeout)
+{
+  nxt_wait_t wait = { match_fw, port_path, false, false, NULL };
+
+  assert(!nxt->dev);
+
+  nxt_wait_event(nxt, &wait, timeout);
+  if (!wait.done)
+    return NXT_NOT_PRESENT;
+
+  nxt->dev = wait.found;
+  nxt->firmware = wait.fw;
+  nxt->interface = nxt_usb_ids[wait.fw].interface;
+  return NXT_OK;
+}
+
+nxt_error_t
+nxt_wait_gone(nxt_t *nxt, nxt_firmware match_fw, const char *port_path,
+              double timeout)
+{
+  nxt_wait_t wait = { match_fw, port_path, true, false, NULL };
+
+  nxt_wait_event(nxt, &wait, timeout);
+  return wait.done ? NXT_OK : NXT_TIMEOUT;
+}
+
+nxt_error_t
+nxt_find_port(nxt_t *nxt, nxt_firmware match_fw, const char *port_path)
+{
+  libusb_device *dev;
+
+  assert(!nxt->dev);
+
+  dev = nxt_find_port_dev(nxt, &match_fw, port_path);
+  if (!dev)
+    return NXT_NOT_PRESENT;
+
+  nxt->dev = dev;
+  nxt->firmware = match_fw;
+  nxt->interface = nxt_usb_ids[match_fw].interface;
+  return NXT_OK;
+}
+
+nxt_error_t
+nxt_list_ports(nxt_t *nxt, nxt_list_ports_cb_t cb, void *user)
+{
+  libusb_device **list;
+
+  ssize_t cnt = libusb_get_device_list(nxt->ctx->usb, &list);
+  if (cnt < 0)
+    return NXT_ERROR_USB(cnt);
+  for (ssize_t i = 0; i < cnt; i++)
+    {
+      libusb_device *dev = list[i];
+      struct libusb_device_descriptor desc;
+      int ret = libusb_get_device_descriptor(dev, &desc);
+      if (ret == 0)
+        {
+          nxt_firmware fw = nxt_get_firmware(&desc);
+          if (fw != N_FIRMWARES)
+            {
+              char path[NXT_PORT_PATH_SIZE];
+              nxt_get_port_path_dev(dev, path, sizeof(path));
+              cb(user, path, fw);
+            }
+        }
+    }
+
+  libusb_free_device_list(list, 1);
+  return NXT_OK;
+}
+
+nxt_error_t
+nxt_reconnect(nxt_t *nxt)
+{
+  char path[NXT_PORT_PATH_SIZE];
+  nxt_firmware fw = nxt->firmware;
+
+  assert(nxt->dev);
+
+  // The device may disappear and come back with a new address, but it
+  // stays on the same port.
+  nxt_get_port_path_dev(nxt->dev, path, sizeof(path));
+  nxt_close(nxt);
+  // Start again from a fresh connection.
+  nxt_release_kept(nxt);
+
+  NXT_ERR(nxt_wait(nxt, fw, path, NXT_RECONNECT_TIMEOUT));
+
+  return nxt_open(nxt);
+}
+
 int
 nxt_is_firmware(nxt_t *nxt, nxt_firmware fw)
 {
   return (nxt->firmware == fw);
 }
 
+typedef struct
+{
+  nxt_error_t err;
+  int transferred;
+} nxt_transfer_sync_t;
+
+static void
+nxt_transfer_sync_cb(void *user, nxt_error_t err, int transferred)
+{
+  nxt_transfer_sync_t *sync = user;
+
+  sync->err = err;
+  sync->transferred = transferred;
+}
+
 static nxt_error_t
-nxt_transfer_buf(nxt_t *nxt, uint8_t endpoint, uint8_t *buf, int len)
+nxt_transfer_buf(nxt_t *nxt, uint8_t endpoint, uint8_t *buf, int len,
+                 double timeout)
 {
   int ret;
-  int transfered;
+  nxt_transfer_sync_t sync;
+  int halt_retries = NXT_USB_HALT_RETRIES;
+  double deadline = nxt_deadline(timeout);
 
   do
     {
-      ret = libusb_bulk_transfer(nxt->hdl, endpoint, buf, len, &transfered, 0);
-      if (ret < 0)
-        return NXT_ERROR_USB(ret);
-      buf += transfered;
-      len -= transfered;
+      // The time limit is for the whole buffer.
+      double left = deadline - nxt_wait_time();
+      nxt_transfer_slot_t *slot;
+      nxt_error_t err;
+
+      if (timeout > 0.0 && left <= 0.0)
+        return NXT_TIMEOUT;
+      NXT_ERR(nxt_submit(nxt, endpoint, buf, len, timeout > 0.0 ? left : 0.0,
+                         nxt_transfer_sync_cb, &sync, &slot));
+      // Only return once the event thread is done with the slot.
+      err = nxt_slot_wait(nxt, slot, deadline);
+      if (err != NXT_OK)
+        {
+          nxt_cancel_transfers(nxt);
+          return err;
+        }
+      buf += sync.transferred;
+      len -= sync.transferred;
+      // On stall, clear the halt condition and continue with the remaining
+      // data.
+      if (sync.err == NXT_ERROR_USB(LIBUSB_ERROR_PIPE) && halt_retries--)
+        {
+          ret = libusb_clear_halt(nxt->hdl, endpoint);
+          if (ret < 0)
+            return NXT_ERROR_USB(ret);
+          continue;
+        }
+      NXT_ERR(sync.err);
     }
   while (len);
 
@@ -385,7 +1618,13 @@ nxt_transfer_buf(nxt_t *nxt, uint8_t endpoint, uint8_t *buf, int len)
 nxt_error_t
 nxt_send_buf(nxt_t *nxt, const uint8_t *buf, int len)
 {
-  return nxt_transfer_buf(nxt, 0x01, (uint8_t *)buf, len);
+  return nxt_transfer_buf(nxt, 0x01, (uint8_t *)buf, len, nxt->timeout);
+}
+
+nxt_error_t
+nxt_send_buf_timeout(nxt_t *nxt, const uint8_t *buf, int len, double timeout)
+{
+  return nxt_transfer_buf(nxt, 0x01, (uint8_t *)buf, len, timeout);
 }
 
 nxt_error_t
@@ -397,5 +1636,11 @@ nxt_send_str(nxt_t *nxt, const char *str)
 nxt_error_t
 nxt_recv_buf(nxt_t *nxt, uint8_t *buf, int len)
 {
-  return nxt_transfer_buf(nxt, 0x82, buf, len);
+  return nxt_transfer_buf(nxt, 0x82, buf, len, nxt->timeout);
+}
+
+nxt_error_t
+nxt_recv_buf_timeout(nxt_t *nxt, uint8_t *buf, int len, double timeout)
+{
+  return nxt_transfer_buf(nxt, 0x82, buf, len, timeout);
 }
@@ -22,13 +22,19 @@
 #ifndef __LOWLEVEL_H__
 #define __LOWLEVEL_H__
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "error.h"
 
-#define NXT_CONNECTION_SIZE sizeof("usb.255.255")
+#define NXT_PORT_PATH_SIZE sizeof("255-255.255.255.255.255.255.255")
+#define NXT_CONNECTION_SIZE (sizeof("usb.") - 1 + NXT_PORT_PATH_SIZE)
 #define NXT_SERIAL_SIZE sizeof("00:16:53:01:02:03")
 
+/* A context can be shared by several device handles, used from different
+ * threads. A device handle must only be used by one thread at a time. */
+typedef struct nxt_context_t nxt_context_t;
 typedef struct nxt_t nxt_t;
 
 typedef enum
@@ -42,17 +48,69 @@ typedef enum
 typedef void (*nxt_list_cb_t)(void *user, const char *connection,
                               nxt_firmware fw, const char *serial,
                               const char *name);
+typedef void (*nxt_list_ports_cb_t)(void *user, const char *port_path,
+                                    nxt_firmware fw);
+/* Called when an asynchronous transfer is done, with the number of bytes
+ * actually transferred, which can be less than requested. Called from
+ * nxt_handle_events or any function waiting for transfers. */
+typedef void (*nxt_transfer_cb_t)(void *user, nxt_error_t err,
+                                  int transferred);
+/* Called when a file descriptor should be watched, events are the poll(2)
+ * events to watch, or when it should not be watched anymore. */
+typedef void (*nxt_pollfd_added_cb_t)(void *user, int fd, short events);
+typedef void (*nxt_pollfd_removed_cb_t)(void *user, int fd);
 
+nxt_error_t nxt_context_init(nxt_context_t **ctx);
+void nxt_context_exit(nxt_context_t *ctx);
+void nxt_refresh(nxt_context_t *ctx);
+nxt_error_t nxt_open_context(nxt_t **nxt, nxt_context_t *ctx);
 nxt_error_t nxt_init(nxt_t **nxt);
 void nxt_exit(nxt_t *nxt);
+nxt_context_t *nxt_get_context(nxt_t *nxt);
+void nxt_set_timeout(nxt_t *nxt, double timeout);
+void nxt_cancel(nxt_t *nxt);
+void nxt_set_persistent(nxt_t *nxt, bool persistent);
 nxt_error_t nxt_list(nxt_t *nxt, nxt_list_cb_t cb, void *user);
+nxt_error_t nxt_list_devices(nxt_t *nxt, bool names, nxt_list_cb_t cb,
+                             void *user);
 nxt_error_t nxt_find(nxt_t *nxt, nxt_firmware match_fw,
                      const char *match_serial, const char *match_name);
+nxt_error_t nxt_list_ports(nxt_t *nxt, nxt_list_ports_cb_t cb, void *user);
+nxt_error_t nxt_find_port(nxt_t *nxt, nxt_firmware match_fw,
+                          const char *port_path);
+nxt_error_t nxt_wait(nxt_t *nxt, nxt_firmware match_fw, const char *port_path,
+                     double timeout);
+/* Wait until no device matching match_fw is left on the port. */
+nxt_error_t nxt_wait_gone(nxt_t *nxt, nxt_firmware match_fw,
+                          const char *port_path, double timeout);
 nxt_error_t nxt_open(nxt_t *nxt);
 void nxt_close(nxt_t *nxt);
+nxt_error_t nxt_reconnect(nxt_t *nxt);
+nxt_error_t nxt_get_port_path(nxt_t *nxt, char *path, size_t path_size);
 int nxt_is_firmware(nxt_t *nxt, nxt_firmware fw);
 nxt_error_t nxt_send_buf(nxt_t *nxt, const uint8_t *buf, int len);
 nxt_error_t nxt_send_str(nxt_t *nxt, const char *str);
 nxt_error_t nxt_recv_buf(nxt_t *nxt, uint8_t *buf, int len);
+nxt_error_t nxt_send_buf_timeout(nxt_t *nxt, const uint8_t *buf, int len,
+                                 double timeout);
+nxt_error_t nxt_recv_buf_timeout(nxt_t *nxt, uint8_t *buf, int len,
+                                 double timeout);
+/* Buffers for transfers, mapped for the device when possible, they must be
+ * freed before the device is closed. */
+uint8_t *nxt_buf_alloc(nxt_t *nxt, size_t size);
+void nxt_buf_free(nxt_t *nxt, uint8_t *buf);
+nxt_error_t nxt_submit_send(nxt_t *nxt, const uint8_t *buf, int len,
+                            nxt_transfer_cb_t cb, void *user);
+nxt_error_t nxt_submit_recv(nxt_t *nxt, uint8_t *buf, int len,
+                            nxt_transfer_cb_t cb, void *user);
+nxt_error_t nxt_handle_events(nxt_context_t *ctx);
+nxt_error_t nxt_handle_events_nowait(nxt_context_t *ctx);
+nxt_error_t nxt_get_pollfds(nxt_context_t *ctx, nxt_pollfd_added_cb_t cb,
+                            void *user);
+void nxt_set_pollfd_notifiers(nxt_context_t *ctx,
+                              nxt_pollfd_added_cb_t added,
+                              nxt_pollfd_removed_cb_t removed, void *user);
+nxt_error_t nxt_get_next_timeout(nxt_context_t *ctx, double *timeout);
+nxt_error_t nxt_flush(nxt_t *nxt);
 
 #endif /* __LOWLEVEL_H__ */
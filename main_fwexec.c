@@ -22,12 +22,14 @@
  */
 
 #include <errno.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 #include "common.h"
+#include "crc.h"
 #include "error.h"
 #include "lowlevel.h"
 #include "samba.h"
@@ -61,8 +63,53 @@ get_firmware(uint8_t **firmware, int *len, const char *filename)
   fclose(f);
 }
 
+#define RAM_START 0x202000
+#define RAM_END 0x210000
+
+static bool
+find_crc_room(long load_addr, int len, nxt_addr_t *crc_addr)
+{
+  long size = NXT_CRC_ROUTINE_SIZE(1);
+  long after = (load_addr + len + 3) & ~3;
+  long before = (load_addr - size) & ~3;
+
+  // Put the CRC routine after the uploaded image, or before it.
+  if (after >= RAM_START && after + size <= RAM_END)
+    *crc_addr = after;
+  else if (before >= RAM_START && before + size <= RAM_END)
+    *crc_addr = before;
+  else
+    return false;
+
+  return true;
+}
+
 static void
-fwexec(const char *filename, long load_addr, long jump_addr,
+check_upload(nxt_t *nxt, const uint8_t *firmware, int firmware_len,
+             long load_addr)
+{
+  nxt_addr_t crc_addr;
+  uint32_t crc;
+
+  if (!find_crc_room(load_addr, firmware_len, &crc_addr))
+    {
+      printf("No room left in RAM to check upload, skipping.\n");
+      return;
+    }
+
+  NXT_HANDLE_ERR(nxt_crc32_remote_load(nxt, crc_addr), nxt,
+                 "Error sending CRC routine");
+  NXT_HANDLE_ERR(
+      nxt_crc32_remote(nxt, crc_addr, load_addr, firmware_len, 1, &crc), nxt,
+      "Error checking upload");
+  if (crc != nxt_crc32(0, firmware, firmware_len))
+    NXT_HANDLE_ERR(NXT_VERIFY_FAILED, nxt, "Error checking upload");
+
+  printf("Firmware upload checked.\n");
+}
+
+static void
+fwexec(const char *filename, long load_addr, long jump_addr, bool check,
        const common_options_t *common_options)
 {
   nxt_t *nxt;
@@ -82,8 +129,13 @@ fwexec(const char *filename, long load_addr, long jump_addr,
          "Uploading firmware...\n");
 
   // Send the C program
-  NXT_HANDLE_ERR(nxt_send_file(nxt, load_addr, firmware, firmware_len), nxt,
-                 "Error Sending file");
+  common_progress_init();
+  NXT_HANDLE_ERR(nxt_send_file_progress(nxt, load_addr, firmware, firmware_len,
+                                        common_progress, NULL),
+                 nxt, "Error Sending file");
+
+  if (check)
+    check_upload(nxt, firmware, firmware_len, load_addr);
 
   printf("Firmware uploaded, executing...\n");
   NXT_HANDLE_ERR(nxt_jump(nxt, jump_addr), nxt, "Error jumping to C program");
@@ -102,7 +154,10 @@ usage(const char *progname, int exit_code)
       "       %s (-l|-h)\n"
       "Upload firmware image to a connected NXT device and run it from RAM.\n"
       "\n"
-      "Options:\n" COMMON_OPTIONS "\n"
+      "Options:\n" COMMON_OPTIONS
+      "Upload options:\n"
+      "  -c         check uploaded image before running it\n"
+      "\n"
       "Example:\n"
       "  %s -l\n"
       "       print detected NXT bricks\n"
@@ -137,11 +192,20 @@ main(int argc, char *const *argv)
   const char *filename = NULL;
   long load_addr;
   long jump_addr;
+  bool check = false;
   int c;
 
-  while ((c = common_getopt(argc, argv, NULL, &common_options, usage)) != -1)
+  while ((c = common_getopt(argc, argv, COMMON_OPTSTRING "c", &common_options,
+                            usage)) != -1)
     {
-      usage(argv[0], 1);
+      switch (c)
+        {
+        case 'c':
+          check = true;
+          break;
+        default:
+          usage(argv[0], 1);
+        }
     }
   if (optind == argc)
     usage(argv[0], 1);
@@ -155,7 +219,7 @@ main(int argc, char *const *argv)
   if (optind < argc)
     usage(argv[0], 1);
 
-  fwexec(filename, load_addr, jump_addr, &common_options);
+  fwexec(filename, load_addr, jump_addr, check, &common_options);
 
   return 0;
 }
@@ -20,23 +20,82 @@
  * USA
  */
 
+#include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "common.h"
+#include "farm.h"
 #include "firmware.h"
+#include "flash.h"
+#include "image.h"
 #include "lowlevel.h"
+#include "manifest.h"
 #include "samba.h"
 
+/* Time to wait for the new firmware to answer, in seconds. */
+#define FWFLASH_BOOT_TIMEOUT 10.0
+
+static nxt_image_t *
+load_image(const char *fw_file, nxt_firmware_options_t *options,
+           const char *manifest_file)
+{
+  nxt_image_t *image;
+  static nxt_manifest_t manifest;
+
+  // Read image from standard input with "-".
+  if (strcmp(fw_file, "-") == 0)
+    NXT_HANDLE_ERR(
+        nxt_image_load_fd(&image, STDIN_FILENO, options->first_page), NULL,
+        "Error");
+  else
+    NXT_HANDLE_ERR(nxt_image_load_at(&image, fw_file, options->first_page),
+                   NULL, "Error");
+
+  // Use the manifest if it is up to date, else create it.
+  if (manifest_file
+      && nxt_manifest_map(&options->manifest, manifest_file, image, fw_file,
+                          options->first_page)
+             != NXT_OK)
+    {
+      NXT_HANDLE_ERR(nxt_manifest_create(&manifest, image, fw_file,
+                                         options->first_page),
+                     NULL, "Error");
+      NXT_HANDLE_ERR(nxt_manifest_save(&manifest, manifest_file), NULL,
+                     "Error writing manifest");
+      options->manifest = &manifest;
+    }
+
+  // A sub-image does not start with the vector table.
+  if (!options->first_page)
+    {
+      if (options->manifest)
+        {
+          if (!(options->manifest->flags & NXT_MANIFEST_VECTORS_VALID))
+            handle_error(NULL, "Error", NXT_INVALID_FIRMWARE);
+        }
+      else
+        NXT_HANDLE_ERR(nxt_image_validate(image), NULL, "Error");
+    }
+
+  return image;
+}
+
 static void
-fwflash(const char *fw_file, const common_options_t *common_options)
+fwflash(const char *fw_file, nxt_firmware_options_t *options, bool check,
+        bool no_wait, const char *manifest_file,
+        const common_options_t *common_options)
 {
   nxt_t *nxt;
+  nxt_image_t *image;
+  nxt_firmware_stats_t stats;
 
   NXT_HANDLE_ERR(nxt_init(&nxt), NULL, "Error during library initialization");
 
-  NXT_HANDLE_ERR(nxt_firmware_validate(fw_file), NULL, "Error");
+  image = load_image(fw_file, options, manifest_file);
 
   common_find_bootloader(nxt, common_options);
 
@@ -45,12 +104,46 @@ fwflash(const char *fw_file, const common_options_t *common_options)
 
   printf("NXT device in reset mode located and opened.\n"
          "Starting firmware flash procedure now...\n");
+  common_progress_init();
 
-  NXT_HANDLE_ERR(nxt_firmware_flash(nxt, fw_file), nxt,
+  NXT_HANDLE_ERR(nxt_firmware_flash_image(nxt, image, options, &stats), nxt,
                  "Error flashing firmware");
   printf("Firmware flash complete.\n");
-  NXT_HANDLE_ERR(nxt_jump(nxt, 0x00100000), nxt, "Error booting new firmware");
-  printf("New firmware started!\n");
+  printf("%d pages programmed, %d pages skipped", stats.pages_written,
+         stats.pages_skipped);
+  if (stats.pages_reprogrammed)
+    printf(", %d pages programmed again after verification",
+           stats.pages_reprogrammed);
+  if (stats.pages_written)
+    printf(", %.1f ms per page", stats.seconds * 1000 / stats.pages_written);
+  printf(".\n");
+  if (check)
+    {
+      NXT_HANDLE_ERR(nxt_firmware_check(nxt, image, options->manifest),
+                     nxt, "Error checking firmware");
+      printf("Firmware checked.\n");
+    }
+  nxt_image_free(image);
+  if (no_wait)
+    {
+      NXT_HANDLE_ERR(nxt_jump(nxt, 0x00100000), nxt,
+                     "Error booting new firmware");
+      printf("New firmware started!\n");
+    }
+  else
+    {
+      nxt_firmware_boot_t boot;
+      nxt_error_t err = nxt_firmware_boot(nxt, FWFLASH_BOOT_TIMEOUT, &boot);
+      if (err == NXT_NOT_PRESENT)
+        printf("New firmware started, but it did not answer.\n");
+      else
+        {
+          NXT_HANDLE_ERR(err, nxt, "Error booting new firmware");
+          printf("New firmware started, enumerated after %.2f s, ready after "
+                 "%.2f s!\n",
+                 boot.enumerated, boot.ready);
+        }
+    }
 
   nxt_close(nxt);
   nxt_exit(nxt);
@@ -64,32 +157,145 @@ usage(const char *progname, int exit_code)
           "       %s (-l|-h)\n"
           "Flash firmware image to a connected NXT device.\n"
           "\n"
-          "Options:\n" COMMON_OPTIONS "\n"
+          "Options:\n" COMMON_OPTIONS
+          "Flash options:\n"
+          "  -d         only program pages which differ from flash content\n"
+          "  -c         check flash content after programming\n"
+          "  -V         read back flash and program mismatching pages again\n"
+          "  -P PROFILE programming profile: default, safe or fast\n"
+          "  -L         lock programmed regions after programming\n"
+          "  -o PAGE    flash a sub-image starting at this page\n"
+          "  -m PAGES   refuse to program more than PAGES pages from start\n"
+          "  -j FILE    resume interrupted flashing using this journal file\n"
+          "  -M FILE    use or create image manifest in this file\n"
+          "  -a         flash all connected bricks at once\n"
+          "  -B         do not wait for the new firmware to answer\n"
+          "\n"
           "Example:\n"
           "  %s -l\n"
           "       print detected NXT bricks\n"
           "  %s nxt_firmware.bin\n"
-          "       locate a NXT brick and flash nxt_firmware.bin file\n",
-          progname, progname, progname, progname);
+          "       locate a NXT brick and flash nxt_firmware.bin file\n"
+          "  %s -a -y nxt_firmware.bin\n"
+          "       reset all connected bricks and flash them at once\n"
+          "  make_firmware | %s -\n"
+          "       flash firmware image read from standard input\n"
+          "  %s -o 128 -m 896 app.bin\n"
+          "       flash app.bin from page 128, leave first pages untouched\n",
+          progname, progname, progname, progname, progname, progname,
+          progname);
   exit(exit_code);
 }
 
+static int
+get_page(const char *progname, const char *s, const char *what, int min,
+         int max)
+{
+  char *end;
+  long r;
+
+  errno = 0;
+  r = strtol(s, &end, 0);
+  if (end == s || *end != '\0' || errno || r < min || r > max)
+    {
+      fprintf(stderr, "Expect a %s, from %d to %d.\n", what, min, max);
+      usage(progname, 1);
+    }
+  return r;
+}
+
 int
 main(int argc, char *const *argv)
 {
   common_options_t common_options = { 0 };
+  nxt_firmware_options_t options = { .retries = 3,
+                                     .progress = common_progress };
+  bool check = false;
+  bool all = false;
+  bool no_wait = false;
+  const char *manifest_file = NULL;
   const char *fw_file = NULL;
   int c;
 
-  while ((c = common_getopt(argc, argv, NULL, &common_options, usage)) != -1)
+  while ((c = common_getopt(argc, argv, COMMON_OPTSTRING "dcVP:Lo:m:j:M:aB",
+                            &common_options, usage))
+         != -1)
     {
-      usage(argv[0], 1);
+      switch (c)
+        {
+        case 'd':
+          options.delta = true;
+          break;
+        case 'c':
+          check = true;
+          break;
+        case 'L':
+          options.relock = true;
+          break;
+        case 'o':
+          options.first_page = get_page(argv[0], optarg, "page number", 0,
+                                        NXT_FLASH_PAGES - 1);
+          break;
+        case 'm':
+          options.page_count = get_page(argv[0], optarg, "page count", 1,
+                                        NXT_FLASH_PAGES);
+          break;
+        case 'V':
+          options.verify = true;
+          break;
+        case 'B':
+          no_wait = true;
+          break;
+        case 'a':
+          all = true;
+          break;
+        case 'M':
+          manifest_file = optarg;
+          break;
+        case 'j':
+          options.journal = optarg;
+          break;
+        case 'P':
+          options.profile = nxt_flash_profile(optarg);
+          if (!options.profile)
+            {
+              fprintf(stderr, "Unknown programming profile: %s\n", optarg);
+              usage(argv[0], 1);
+            }
+          break;
+        default:
+          usage(argv[0], 1);
+        }
     }
   if (optind + 1 != argc)
     usage(argv[0], 1);
   fw_file = argv[optind];
 
-  fwflash(fw_file, &common_options);
+  if (manifest_file && strcmp(fw_file, "-") == 0)
+    {
+      fprintf(stderr, "Manifest can not be used with standard input.\n");
+      usage(argv[0], 1);
+    }
+
+  if (all
+      && (common_options.match_port || common_options.match_serial
+          || common_options.match_name))
+    {
+      fprintf(stderr, "Only -b can select devices with several bricks.\n");
+      usage(argv[0], 1);
+    }
+
+  if (all && options.journal)
+    {
+      fprintf(stderr, "Journal can not be used with several bricks.\n");
+      usage(argv[0], 1);
+    }
+
+  if (all)
+    return farm_flash(load_image(fw_file, &options, manifest_file), &options,
+                      check, no_wait, &common_options);
+
+  fwflash(fw_file, &options, check, no_wait, manifest_file, &common_options);
 
   return 0;
 }
@@ -1,6 +1,6 @@
 #!/usr/bin/env python3
 #
-"""Embed flash routine as an array of bytes in a header file."""
+"""Embed flash or CRC routine as an array of bytes in a header file."""
 #
 # Copyright 2006 David Anderson <dave@natulte.net>
 #
@@ -24,7 +24,7 @@ import sys
 
 p = argparse.ArgumentParser(description=__doc__)
 p.add_argument('binary',
-               help='flash routine binary file')
+               help='routine binary file')
 p.add_argument('template',
                help='header template')
 p.add_argument('-o', '--output', metavar='output', required=True,
@@ -36,7 +36,7 @@ with open(options.binary, 'rb') as f:
     fwbin = f.read()
 
 if len(fwbin) > 1024:
-    print("The flash driver looks too big, refusing to embed.",
+    print("The routine looks too big, refusing to embed.",
           file=sys.stderr)
     sys.exit(1)
 
@@ -0,0 +1,183 @@
+/**
+ * NXT bootstrap interface; firmware image manifest.
+ *
+ * Copyright 2026 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "manifest.h"
+
+#include "crc.h"
+#include "journal.h"
+
+static nxt_error_t
+nxt_manifest_source(const char *image_path, uint32_t *size, uint64_t *mtime)
+{
+  struct stat s;
+
+  *size = 0;
+  *mtime = 0;
+  if (!image_path)
+    return NXT_OK;
+
+  if (stat(image_path, &s) < 0)
+    return NXT_FILE_ERROR;
+  *size = s.st_size;
+  *mtime = (uint64_t)s.st_mtim.tv_sec * 1000000000 + s.st_mtim.tv_nsec;
+
+  return NXT_OK;
+}
+
+nxt_error_t
+nxt_manifest_create(nxt_manifest_t *manifest, const nxt_image_t *image,
+                    const char *image_path, int page)
+{
+  uint8_t blank[NXT_FLASH_PAGE_SIZE];
+  uint32_t blank_crc;
+
+  memset(manifest, 0, sizeof(*manifest));
+  manifest->magic = NXT_MANIFEST_MAGIC;
+  NXT_ERR(nxt_manifest_source(image_path, &manifest->source_size,
+                              &manifest->source_mtime_ns));
+  manifest->source_page = page;
+  manifest->digest = nxt_journal_digest(image);
+  manifest->pages = image->pages;
+  if (nxt_image_validate(image) == NXT_OK)
+    manifest->flags |= NXT_MANIFEST_VECTORS_VALID;
+  // Pages after the image are not available, they are blank.
+  memset(blank, 0xff, sizeof(blank));
+  blank_crc = nxt_crc32(0, blank, sizeof(blank));
+  for (int i = 0; i < 8; i++)
+    {
+      const uint8_t *p = (image->pages ? image->data : blank) + i * 4;
+      manifest->vectors[i] = p[0] | p[1] << 8 | p[2] << 16
+                             | (uint32_t)p[3] << 24;
+    }
+  for (int i = 0; i < NXT_FLASH_PAGES; i++)
+    {
+      if (image->populated[i])
+        manifest->populated[i / 32] |= 1u << (i % 32);
+      if (nxt_image_page_blank(image, i))
+        manifest->blank[i / 32] |= 1u << (i % 32);
+      if (i < image->pages)
+        manifest->page_crc[i] = nxt_crc32(
+            0, image->data + i * NXT_FLASH_PAGE_SIZE, NXT_FLASH_PAGE_SIZE);
+      else
+        manifest->page_crc[i] = blank_crc;
+    }
+
+  return NXT_OK;
+}
+
+nxt_error_t
+nxt_manifest_save(const nxt_manifest_t *manifest, const char *path)
+{
+  FILE *f;
+  char *tmp;
+  int ok;
+
+  // Write to a temporary file, then rename, so that other processes never
+  // map a half written manifest.
+  tmp = malloc(strlen(path) + sizeof(".tmp"));
+  if (!tmp)
+    return NXT_ERROR_NO_MEM;
+  strcpy(tmp, path);
+  strcat(tmp, ".tmp");
+
+  f = fopen(tmp, "wb");
+  if (!f)
+    {
+      free(tmp);
+      return NXT_FILE_ERROR;
+    }
+  ok = fwrite(manifest, sizeof(*manifest), 1, f) == 1;
+  ok = fclose(f) == 0 && ok;
+  ok = ok && rename(tmp, path) == 0;
+  if (!ok)
+    remove(tmp);
+  free(tmp);
+
+  return ok ? NXT_OK : NXT_FILE_ERROR;
+}
+
+nxt_error_t
+nxt_manifest_map(const nxt_manifest_t **manifest, const char *path,
+                 const nxt_image_t *image, const char *image_path, int page)
+{
+  const nxt_manifest_t *m;
+  struct stat s;
+  uint32_t size;
+  uint64_t mtime;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NXT_FILE_ERROR;
+  if (fstat(fd, &s) < 0 || s.st_size != sizeof(*m))
+    {
+      close(fd);
+      return NXT_FILE_ERROR;
+    }
+  m = mmap(NULL, sizeof(*m), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED)
+    return NXT_FILE_ERROR;
+
+  // Refuse manifest from an other host, or for an other version of the
+  // image file, or loaded at an other place. The file size and time are
+  // cheap to check, but the image may change without changing them, so
+  // also check the content of the loaded image.
+  if (m->magic != NXT_MANIFEST_MAGIC
+      || nxt_manifest_source(image_path, &size, &mtime) != NXT_OK
+      || m->source_size != size || m->source_mtime_ns != mtime
+      || m->source_page != (uint32_t)page
+      || m->pages != (uint32_t)image->pages
+      || m->digest != nxt_journal_digest(image))
+    {
+      nxt_manifest_unmap(m);
+      return NXT_FILE_ERROR;
+    }
+
+  *manifest = m;
+  return NXT_OK;
+}
+
+void
+nxt_manifest_unmap(const nxt_manifest_t *manifest)
+{
+  munmap((void *)manifest, sizeof(*manifest));
+}
+
+bool
+nxt_manifest_page_populated(const nxt_manifest_t *manifest, int page)
+{
+  return manifest->populated[page / 32] & (1u << (page % 32));
+}
+
+bool
+nxt_manifest_page_blank(const nxt_manifest_t *manifest, int page)
+{
+  return manifest->blank[page / 32] & (1u << (page % 32));
+}
@@ -0,0 +1,75 @@
+/**
+ * NXT bootstrap interface; firmware image manifest.
+ *
+ * Copyright 2026 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#ifndef __MANIFEST_H__
+#define __MANIFEST_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "image.h"
+
+#define NXT_MANIFEST_MAGIC 0x314d584e /* "NXM1" */
+
+/* The vector table was found valid. */
+#define NXT_MANIFEST_VECTORS_VALID 0x1
+
+/* Precomputed information about an image, to be saved in a file next to the
+ * image and mapped in memory on later runs. It is stored in host byte order,
+ * a manifest from a host of different byte order has a wrong magic. */
+typedef struct
+{
+  uint32_t magic;
+  /* Size and modification time of the image file, to detect a stale
+   * manifest. */
+  uint32_t source_size;
+  uint64_t source_mtime_ns;
+  /* Page where the image file was loaded, see nxt_image_load_at. */
+  uint32_t source_page;
+  /* Image digest, see nxt_journal_digest, checked against the loaded image
+   * before the manifest is used. */
+  uint32_t digest;
+  /* Number of pages in image, up to the last populated page. */
+  uint32_t pages;
+  uint32_t flags;
+  /* Vector table, first eight words of the image. */
+  uint32_t vectors[8];
+  /* Bitmaps of populated pages and of blank pages. */
+  uint32_t populated[NXT_FLASH_PAGES / 32];
+  uint32_t blank[NXT_FLASH_PAGES / 32];
+  /* CRC32 of each page. */
+  uint32_t page_crc[NXT_FLASH_PAGES];
+} nxt_manifest_t;
+
+nxt_error_t nxt_manifest_create(nxt_manifest_t *manifest,
+                                const nxt_image_t *image,
+                                const char *image_path, int page);
+nxt_error_t nxt_manifest_save(const nxt_manifest_t *manifest,
+                              const char *path);
+nxt_error_t nxt_manifest_map(const nxt_manifest_t **manifest, const char *path,
+                             const nxt_image_t *image, const char *image_path,
+                             int page);
+void nxt_manifest_unmap(const nxt_manifest_t *manifest);
+bool nxt_manifest_page_populated(const nxt_manifest_t *manifest, int page);
+bool nxt_manifest_page_blank(const nxt_manifest_t *manifest, int page);
+
+#endif /* __MANIFEST_H__ */
@@ -22,9 +22,15 @@
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include "samba.h"
 
+/* Size of each send command when reporting progress. */
+#define NXT_SEND_CHUNK 4096
+/* Length of a command with two arguments, without the final NUL. */
+#define NXT_COMMAND2_LEN (sizeof("S00000000,00000000#") - 1)
+
 static nxt_error_t
 nxt_format_command2(char *buf, char cmd, nxt_addr_t addr, nxt_word_t word)
 {
@@ -57,8 +63,8 @@ nxt_handshake(nxt_t *nxt)
 {
   uint8_t buf[2];
 
-  nxt_send_str(nxt, "N#");
-  nxt_recv_buf(nxt, buf, 2);
+  NXT_ERR(nxt_send_str(nxt, "N#"));
+  NXT_ERR(nxt_recv_buf(nxt, buf, 2));
   if (memcmp(buf, "\n\r", 2) != 0)
     return NXT_HANDSHAKE_FAILED;
 
@@ -141,17 +147,169 @@ nxt_send_file(nxt_t *nxt, nxt_addr_t addr, const uint8_t *file,
   return NXT_OK;
 }
 
+nxt_error_t
+nxt_send_file_progress(nxt_t *nxt, nxt_addr_t addr, const uint8_t *file,
+                       unsigned short len, nxt_progress_cb_t cb, void *user)
+{
+  nxt_progress_tracker_t tracker;
+  unsigned short done = 0;
+
+  /* Send in several commands, so that progress can be reported, and
+   * cancellation does not leave SAM-BA waiting for data. */
+  nxt_progress_start(&tracker, cb, user, len, 0);
+  while (done < len)
+    {
+      unsigned short chunk = len - done;
+      if (chunk > NXT_SEND_CHUNK)
+        chunk = NXT_SEND_CHUNK;
+      NXT_ERR(nxt_send_file(nxt, addr + done, file + done, chunk));
+      done += chunk;
+      NXT_ERR(nxt_progress_update(&tracker, done, 0));
+    }
+
+  return NXT_OK;
+}
+
 nxt_error_t
 nxt_recv_file(nxt_t *nxt, nxt_addr_t addr, uint8_t *file, unsigned short len)
 {
   char buf[20];
 
+  /* SAM-BA fails to read power of two sizes over 32 bytes through USB,
+   * read the first byte separately. */
+  if (len > 32 && !(len & (len - 1)))
+    {
+      NXT_ERR(nxt_read_byte(nxt, addr, file));
+      addr++;
+      file++;
+      len--;
+    }
+
   NXT_ERR(nxt_format_command2(buf, 'R', addr, len));
   NXT_ERR(nxt_send_str(nxt, buf));
-  NXT_ERR(nxt_recv_buf(nxt, file, len + 1));
+  NXT_ERR(nxt_recv_buf(nxt, file, len));
   return NXT_OK;
 }
 
+nxt_error_t
+nxt_samba_buf_alloc(nxt_t *nxt, nxt_samba_buf_t *buf, unsigned short size)
+{
+  buf->mem = nxt_buf_alloc(nxt, NXT_SAMBA_BUF_HEADER + size);
+  if (!buf->mem)
+    return NXT_ERROR_NO_MEM;
+  buf->data = buf->mem + NXT_SAMBA_BUF_HEADER;
+  buf->size = size;
+  return NXT_OK;
+}
+
+void
+nxt_samba_buf_free(nxt_t *nxt, nxt_samba_buf_t *buf)
+{
+  nxt_buf_free(nxt, buf->mem);
+  buf->mem = buf->data = NULL;
+}
+
+/* State of one queued transfer, completion order of the command and data
+ * transfers is not known. */
+typedef struct
+{
+  nxt_error_t err;
+  int transferred;
+} nxt_samba_queue_t;
+
+static void
+nxt_samba_queue_cb(void *user, nxt_error_t err, int transferred)
+{
+  nxt_samba_queue_t *queue = user;
+
+  queue->err = err;
+  queue->transferred = transferred;
+}
+
+static nxt_error_t
+nxt_samba_queue(nxt_t *nxt, char cmd, nxt_addr_t addr, nxt_samba_buf_t *buf,
+                unsigned short len)
+{
+  char command[NXT_COMMAND2_LEN + 1];
+  uint8_t *p = buf->data - NXT_COMMAND2_LEN;
+  nxt_samba_queue_t cmd_queue = { NXT_OK, 0 };
+  nxt_samba_queue_t data_queue = { NXT_OK, 0 };
+  nxt_error_t err;
+
+  assert(len <= buf->size);
+
+  // The command is written just before the data, but it must be sent in its
+  // own USB packet, queue two transfers without waiting in between.
+  NXT_ERR(nxt_format_command2(command, cmd, addr, len));
+  memcpy(p, command, NXT_COMMAND2_LEN);
+  err = nxt_submit_send(nxt, p, NXT_COMMAND2_LEN, nxt_samba_queue_cb,
+                        &cmd_queue);
+  if (err == NXT_OK && len)
+    {
+      if (cmd == 'S')
+        err = nxt_submit_send(nxt, buf->data, len, nxt_samba_queue_cb,
+                              &data_queue);
+      else
+        err = nxt_submit_recv(nxt, buf->data, len, nxt_samba_queue_cb,
+                              &data_queue);
+    }
+  // Wait for submitted transfers even on error, queue is on the stack.
+  NXT_ERR(nxt_flush(nxt));
+  NXT_ERR(err);
+  NXT_ERR(cmd_queue.err);
+  NXT_ERR(data_queue.err);
+
+  // A partial command can not be completed, data is already queued after
+  // it.
+  if (cmd_queue.transferred != NXT_COMMAND2_LEN)
+    return NXT_ERROR_PROTO;
+  if (!len)
+    return NXT_OK;
+  if (data_queue.transferred < 0 || data_queue.transferred > len)
+    return NXT_ERROR_PROTO;
+
+  // Data can be transferred in several parts, do the rest.
+  if (data_queue.transferred < len)
+    {
+      uint8_t *rest = buf->data + data_queue.transferred;
+      int rest_len = len - data_queue.transferred;
+
+      if (cmd == 'S')
+        NXT_ERR(nxt_send_buf(nxt, rest, rest_len));
+      else
+        NXT_ERR(nxt_recv_buf(nxt, rest, rest_len));
+    }
+
+  return NXT_OK;
+}
+
+nxt_error_t
+nxt_send_samba_buf(nxt_t *nxt, nxt_addr_t addr, nxt_samba_buf_t *buf,
+                   unsigned short len)
+{
+  return nxt_samba_queue(nxt, 'S', addr, buf, len);
+}
+
+nxt_error_t
+nxt_recv_samba_buf(nxt_t *nxt, nxt_addr_t addr, nxt_samba_buf_t *buf,
+                   unsigned short len)
+{
+  /* Same power of two size quirk as nxt_recv_file. */
+  if (len > 32 && !(len & (len - 1)))
+    {
+      nxt_samba_buf_t rest = { buf->mem, buf->data + 1, buf->size - 1 };
+      nxt_byte_t first;
+
+      // The command for the rest overwrites the first data byte.
+      NXT_ERR(nxt_read_byte(nxt, addr, &first));
+      NXT_ERR(nxt_samba_queue(nxt, 'R', addr + 1, &rest, len - 1));
+      buf->data[0] = first;
+      return NXT_OK;
+    }
+
+  return nxt_samba_queue(nxt, 'R', addr, buf, len);
+}
+
 nxt_error_t
 nxt_jump(nxt_t *nxt, nxt_addr_t addr)
 {
@@ -173,3 +331,53 @@ nxt_samba_version(nxt_t *nxt, char *version)
   version[4] = 0;
   return NXT_OK;
 }
+
+double
+nxt_progress_time(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+nxt_progress_start(nxt_progress_tracker_t *tracker, nxt_progress_cb_t cb,
+                   void *user, unsigned long bytes_total, int pages_total)
+{
+  memset(tracker, 0, sizeof(*tracker));
+  tracker->cb = cb;
+  tracker->user = user;
+  tracker->progress.bytes_total = bytes_total;
+  tracker->progress.pages_total = pages_total;
+  tracker->progress.eta = -1.0;
+  tracker->start = tracker->last = nxt_progress_time();
+}
+
+nxt_error_t
+nxt_progress_update(nxt_progress_tracker_t *tracker, unsigned long bytes,
+                    int pages)
+{
+  nxt_progress_t *p = &tracker->progress;
+  double now;
+
+  if (!tracker->cb)
+    return NXT_OK;
+
+  now = nxt_progress_time();
+  p->elapsed = now - tracker->start;
+  if (now > tracker->last)
+    p->rate = (bytes - p->bytes) / (now - tracker->last);
+  if (p->elapsed > 0)
+    p->average_rate = bytes / p->elapsed;
+  if (p->average_rate > 0 && bytes <= p->bytes_total)
+    p->eta = (p->bytes_total - bytes) / p->average_rate;
+  p->bytes = bytes;
+  p->pages = pages;
+  tracker->last = now;
+
+  if (!tracker->cb(tracker->user, p))
+    return NXT_CANCELLED;
+
+  return NXT_OK;
+}
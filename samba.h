@@ -22,6 +22,7 @@
 #ifndef __SAMBA_H__
 #define __SAMBA_H__
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "error.h"
@@ -32,6 +33,58 @@ typedef uint32_t nxt_word_t;
 typedef uint16_t nxt_hword_t;
 typedef uint8_t nxt_byte_t;
 
+/* Room left for the SAM-BA command before the data of a buffer. */
+#define NXT_SAMBA_BUF_HEADER 32
+
+/* Buffer for SAM-BA data transfers, with room for the command just before
+ * the data, so that both can be queued together without copy. */
+typedef struct
+{
+  uint8_t *mem;
+  uint8_t *data;
+  unsigned short size;
+} nxt_samba_buf_t;
+
+/* Progress of a long operation. */
+typedef struct
+{
+  /* Bytes transferred so far, and expected total. */
+  unsigned long bytes;
+  unsigned long bytes_total;
+  /* Flash pages programmed so far, and expected total, zero when not
+   * flashing. */
+  int pages;
+  int pages_total;
+  /* Time since start, in seconds. */
+  double elapsed;
+  /* Throughput in bytes per second, since previous report and since
+   * start. */
+  double rate;
+  double average_rate;
+  /* Estimated remaining time in seconds, negative when unknown. */
+  double eta;
+} nxt_progress_t;
+
+/* Progress callback, return false to cancel the operation. */
+typedef bool (*nxt_progress_cb_t)(void *user, const nxt_progress_t *progress);
+
+/* Progress state, used by operations reporting progress. */
+typedef struct
+{
+  nxt_progress_cb_t cb;
+  void *user;
+  nxt_progress_t progress;
+  double start;
+  double last;
+} nxt_progress_tracker_t;
+
+double nxt_progress_time(void);
+void nxt_progress_start(nxt_progress_tracker_t *tracker, nxt_progress_cb_t cb,
+                        void *user, unsigned long bytes_total,
+                        int pages_total);
+nxt_error_t nxt_progress_update(nxt_progress_tracker_t *tracker,
+                                unsigned long bytes, int pages);
+
 nxt_error_t nxt_handshake(nxt_t *nxt);
 
 nxt_error_t nxt_write_byte(nxt_t *nxt, nxt_addr_t addr, nxt_byte_t b);
@@ -44,9 +97,20 @@ nxt_error_t nxt_read_word(nxt_t *nxt, nxt_addr_t addr, nxt_word_t *w);
 
 nxt_error_t nxt_send_file(nxt_t *nxt, nxt_addr_t addr, const uint8_t *file,
                           unsigned short len);
+nxt_error_t nxt_send_file_progress(nxt_t *nxt, nxt_addr_t addr,
+                                   const uint8_t *file, unsigned short len,
+                                   nxt_progress_cb_t cb, void *user);
 nxt_error_t nxt_recv_file(nxt_t *nxt, nxt_addr_t addr, uint8_t *file,
                           unsigned short len);
 
+nxt_error_t nxt_samba_buf_alloc(nxt_t *nxt, nxt_samba_buf_t *buf,
+                                unsigned short size);
+void nxt_samba_buf_free(nxt_t *nxt, nxt_samba_buf_t *buf);
+nxt_error_t nxt_send_samba_buf(nxt_t *nxt, nxt_addr_t addr,
+                               nxt_samba_buf_t *buf, unsigned short len);
+nxt_error_t nxt_recv_samba_buf(nxt_t *nxt, nxt_addr_t addr,
+                               nxt_samba_buf_t *buf, unsigned short len);
+
 nxt_error_t nxt_jump(nxt_t *nxt, nxt_addr_t addr);
 
 nxt_error_t nxt_samba_version(nxt_t *nxt, char *version);
@@ -0,0 +1,146 @@
+/**
+ * NXT bootstrap interface; firmware image loading tests.
+ *
+ * Copyright 2026 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "image.h"
+
+#define CHECK(cond)                                              \
+  do                                                             \
+    {                                                            \
+      if (!(cond))                                               \
+        {                                                        \
+          fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, \
+                  __LINE__, #cond);                              \
+          return 1;                                              \
+        }                                                        \
+    }                                                            \
+  while (0)
+
+static void
+put_word(uint8_t *p, uint32_t w)
+{
+  p[0] = w & 0xff;
+  p[1] = (w >> 8) & 0xff;
+  p[2] = (w >> 16) & 0xff;
+  p[3] = (w >> 24) & 0xff;
+}
+
+/* Raw image whose first vector is a branch forward, 0xea00003a, stored as
+ * ':', which must not be taken for Intel HEX. */
+static int
+test_raw_colon(void)
+{
+  uint8_t raw[4 * NXT_FLASH_PAGE_SIZE];
+  nxt_image_t *image;
+
+  for (size_t i = 0; i < sizeof(raw); i++)
+    raw[i] = i * 7;
+  for (int i = 0; i < 8; i++)
+    put_word(raw + i * 4, 0xea00003a);
+  CHECK(raw[0] == ':');
+
+  CHECK(nxt_image_load_buffer(&image, raw, sizeof(raw), 0) == NXT_OK);
+  CHECK(image->pages == 4);
+  CHECK(image->populated[3] && !image->populated[4]);
+  CHECK(memcmp(image->data, raw, sizeof(raw)) == 0);
+  CHECK(nxt_image_validate(image) == NXT_OK);
+  // Whole pages from the start of flash are used in place.
+  CHECK(image->data == raw);
+  CHECK(nxt_image_page_blank(image, 4));
+  nxt_image_free(image);
+
+  return 0;
+}
+
+/* Raw data starting with 'S' and a hex digit, not an S-record. */
+static int
+test_raw_srec_like(void)
+{
+  uint8_t raw[NXT_FLASH_PAGE_SIZE];
+  nxt_image_t *image;
+
+  memset(raw, 0, sizeof(raw));
+  memcpy(raw, "S1", 2);
+
+  CHECK(nxt_image_load_buffer(&image, raw, sizeof(raw), 2) == NXT_OK);
+  CHECK(image->pages == 3);
+  CHECK(!image->populated[0] && image->populated[2]);
+  CHECK(memcmp(image->data + 2 * NXT_FLASH_PAGE_SIZE, raw, sizeof(raw)) ==
+        0);
+  CHECK(image->data[0] == 0xff);
+  CHECK(nxt_image_page_blank(image, 0));
+  nxt_image_free(image);
+
+  return 0;
+}
+
+/* Valid Intel HEX is still recognized, with data at the start of flash. */
+static int
+test_ihex(void)
+{
+  static const char ihex[] = ":020000040010EA\r\n"
+                             ":0400000001020304F2\r\n"
+                             ":00000001FF\r\n";
+  nxt_image_t *image;
+
+  CHECK(nxt_image_load_buffer(&image, (const uint8_t *)ihex,
+                              sizeof(ihex) - 1, 0) == NXT_OK);
+  CHECK(image->pages == 1);
+  CHECK(image->data[0] == 1 && image->data[3] == 4);
+  CHECK(image->data[4] == 0xff);
+  nxt_image_free(image);
+
+  return 0;
+}
+
+/* Intel HEX followed by binary data is a raw image. */
+static int
+test_ihex_trailing(void)
+{
+  static const char ihex[] = ":020000040010EA\n"
+                             ":0400000001020304F2\n"
+                             ":00000001FF\n"
+                             "\x01";
+  nxt_image_t *image;
+
+  CHECK(nxt_image_load_buffer(&image, (const uint8_t *)ihex,
+                              sizeof(ihex) - 1, 0) == NXT_OK);
+  CHECK(image->pages == 1);
+  CHECK(memcmp(image->data, ihex, sizeof(ihex) - 1) == 0);
+  nxt_image_free(image);
+
+  return 0;
+}
+
+int
+main(void)
+{
+  int fails = 0;
+
+  fails += test_raw_colon();
+  fails += test_raw_srec_like();
+  fails += test_ihex();
+  fails += test_ihex_trailing();
+
+  return fails ? 1 : 0;
+}